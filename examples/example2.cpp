@@ -0,0 +1,190 @@
+#include "sqface.h"
+#include <sys/time.h>
+#include <unistd.h>
+
+// Кадров в кольце: буферы выделяются один раз, чтение синхронное -
+// последние RING_SIZE кадров просто остаются в памяти
+#define RING_SIZE 4
+
+static double now() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec/1e6;
+}
+
+// Прочитать ровно n байт (из stdin fread может вернуть меньше)
+static int read_full(FILE *f, BYTE *p, size_t n) {
+	while (n > 0) {
+		size_t r = fread(p, 1, n, f);
+		if (r == 0) return -1;
+		p += r;
+		n -= r;
+	}
+	return 0;
+}
+
+// Строка заголовка Y4M (до '\n'), без '\n'
+static int read_line(FILE *f, char *s, int n) {
+	int i = 0, c;
+	while ((c = fgetc(f)) != EOF && c != '\n') {
+		if (i < n-1) s[i++] = c;
+	}
+	s[i] = 0;
+	return (c == EOF && i == 0) ? -1 : i;
+}
+
+// Параметр заголовка (до пробела) - ровно tok
+static int is_token(const char *s, size_t n, const char *tok) {
+	return strlen(tok) == n && !strncmp(s, tok, n);
+}
+
+// Заголовок YUV4MPEG2: размер и сколько байт цветности на кадр
+static int parse_y4m(const char *s, int *w, int *h, size_t *chroma) {
+	const char *cs = "420";
+	size_t n = 3;
+	*w = *h = 0;
+	for (const char *t = strchr(s, ' '); t; t = strchr(t+1, ' ')) {
+		if (t[1] == 'W') *w = atoi(t+2);
+		if (t[1] == 'H') *h = atoi(t+2);
+		if (t[1] == 'C') {
+			cs = t+2;
+			n = strcspn(cs, " ");
+		}
+	}
+	if (*w <= 0 || *h <= 0) return -1;
+	size_t cw = (*w+1)/2, ch = (*h+1)/2;
+	if (is_token(cs, n, "mono")) *chroma = 0;
+	else if (is_token(cs, n, "444")) *chroma = 2*(size_t)*w**h;
+	else if (is_token(cs, n, "422")) *chroma = 2*cw**h;
+	else if (is_token(cs, n, "420") || is_token(cs, n, "420jpeg") ||
+			is_token(cs, n, "420paldv") || is_token(cs, n, "420mpeg2")) *chroma = 2*cw*ch;
+	else return -1; // 411, 10-16 бит (420p10, mono16 и т.п.), альфа (444alpha)
+	return 0;
+}
+
+int main (int argc, char **argv) {
+	const char *filename_i_txt = "haarcascade_frontalface_alt.xml";
+	const char *format = NULL; // nv12, i420 - без заголовка, нужен -s
+	int w = 0, h = 0;
+	int track_every = 0; // -t: RecognizeFrame(), полный проход раз в столько кадров
+	int changed_only = 0; // -c: UpdateGray() и SQFACE_SCAN_CHANGED
+	int quiet = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "f:s:t:cq")) != -1) {
+		switch (opt) {
+			case 'f': format = optarg; break;
+			case 's': if (sscanf(optarg, "%dx%d", &w, &h) != 2) w = h = 0; break;
+			case 't': track_every = atoi(optarg); break;
+			case 'c': changed_only = 1; break;
+			case 'q': quiet = 1; break;
+			default: optind = argc+1; break;
+		}
+	}
+	if (optind >= argc || (format && (strcmp(format, "nv12") && strcmp(format, "i420"))) || (format && (w <= 0 || h <= 0))) {
+		printf("%s [-f nv12|i420 -s WxH] [-t full_every] [-c] [-q] [video.y4m|video.yuv|-] [haar_i_txt]\n", argv[0]);
+		return -1;
+	}
+	if (optind+1 < argc) filename_i_txt = argv[optind+1];
+
+	FILE *f = strcmp(argv[optind], "-") ? fopen(argv[optind], "rb") : stdin;
+	if (!f) {
+		perror(argv[optind]);
+		return -1;
+	}
+
+	int y4m = !format;
+	size_t chroma = 0;
+	char line[256];
+	if (y4m) {
+		if (read_line(f, line, sizeof(line)) < 0 || strncmp(line, "YUV4MPEG2 ", 10) ||
+				parse_y4m(line, &w, &h, &chroma) < 0) {
+			printf("not an 8-bit YUV4MPEG2 4:2:0/4:2:2/4:4:4/mono stream\n");
+			return -1;
+		}
+	} else {
+		// NV12 и I420 - одинаково: Y, потом цветность четверти размера
+		chroma = 2*(size_t)((w+1)/2)*((h+1)/2);
+	}
+
+	TFaceRecognizer *Rec = new TFaceRecognizer();
+	if (Rec->LoadCascadeXML(filename_i_txt) < 0) {
+		printf("failed to load '%s'\n", filename_i_txt);
+		return -1;
+	}
+	TRecognizeParams params;
+	params.min_neighbors = 3;
+	if (changed_only) params.flags |= SQFACE_SCAN_CHANGED;
+	TTrackParams track;
+	track.full_every = track_every;
+
+	// Кольцо кадров: буферы выделены один раз, дальше только fread() в них
+	size_t frame_size = (size_t)w*h + chroma;
+	BYTE *ring[RING_SIZE];
+	for (int i = 0; i < RING_SIZE; i++) {
+		ring[i] = (BYTE *)malloc(frame_size);
+		if (!ring[i]) {
+			printf("No free memory.\n");
+			return -1;
+		}
+	}
+
+	int n_frames = 0;
+	long long n_faces = 0;
+	double t_read = 0, t_detect = 0;
+	double t0 = now();
+	for (;;) {
+		BYTE *frame = ring[n_frames % RING_SIZE];
+		double t = now();
+		if (y4m) {
+			// "FRAME[ параметры]\n"
+			if (read_line(f, line, sizeof(line)) < 0) break;
+			if (strncmp(line, "FRAME", 5)) {
+				printf("frame %d: bad header '%s'\n", n_frames, line);
+				break;
+			}
+		}
+		if (read_full(f, frame, frame_size) < 0) break;
+		double t1 = now();
+		t_read += t1-t;
+
+		// Только Y-плоскость: строки сверху вниз, stride = w
+		int ret;
+		if (changed_only) {
+			ret = Rec->UpdateGray(frame, w, h, w);
+		} else {
+			ret = Rec->LoadGray(frame, w, h, w);
+		}
+		if (ret >= 0) {
+			if (track_every > 0) ret = Rec->RecognizeFrame(1.2, &params, &track);
+			else ret = Rec->Recognize(1.2, &params);
+		}
+		t_detect += now()-t1;
+		if (ret < 0) {
+			printf("frame %d: failed\n", n_frames);
+			break;
+		}
+
+		n_faces += ret;
+		if (!quiet) {
+			printf("frame %d: %d", n_frames, ret);
+			for (int i = 0; i < ret; i++) {
+				const TFace *face = Rec->GetFace(i);
+				printf(" [%d %d %d %d]", face->x1, face->y1, face->x2, face->y2);
+			}
+			printf("\n");
+		}
+		n_frames++;
+	}
+	double t_all = now()-t0;
+
+	printf("%d frames %d x %d, %lld faces, %.1f ms (read %.1f, detect %.1f), %.2f fps\n",
+			n_frames, w, h, n_faces, t_all*1000, t_read*1000, t_detect*1000,
+			t_all > 0 ? n_frames/t_all : 0.0);
+
+	for (int i = 0; i < RING_SIZE; i++) free(ring[i]);
+	if (f != stdin) fclose(f);
+	delete Rec;
+
+	return 0;
+}
@@ -0,0 +1,93 @@
+#include "sqbatch.h"
+#include <sys/time.h>
+#include <unistd.h>
+
+static double now() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec/1e6;
+}
+
+int main (int argc, char **argv) {
+	int n_decode = 0, n_build = 0, n_detect = 0; // 0 - по числу процессоров
+	int serial = 0; // -s: для сравнения - LoadImage() и Recognize() по очереди
+	int quiet = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:b:r:sq")) != -1) {
+		switch (opt) {
+			case 'd': n_decode = atoi(optarg); break;
+			case 'b': n_build = atoi(optarg); break;
+			case 'r': n_detect = atoi(optarg); break;
+			case 's': serial = 1; break;
+			case 'q': quiet = 1; break;
+			default: optind = argc+1; break;
+		}
+	}
+	if (optind+1 >= argc) {
+		printf("%s [-d decode_threads] [-b build_threads] [-r detect_threads] [-s] [-q] [haar_i_txt] [filename_i ...]\n", argv[0]);
+		return -1;
+	}
+	const char *filename_i_txt = argv[optind];
+	const char * const *filenames = argv+optind+1;
+	int n = argc-optind-1;
+
+	TRecognizeParams params;
+	params.min_neighbors = 3;
+
+	if (serial) {
+		TFaceRecognizer *Rec = new TFaceRecognizer();
+		if (Rec->LoadCascadeXML(filename_i_txt) < 0) {
+			printf("failed to load '%s'\n", filename_i_txt);
+			return -1;
+		}
+		long long n_faces = 0;
+		double t0 = now();
+		for (int i = 0; i < n; i++) {
+			int ret = Rec->LoadImage(filenames[i]);
+			if (ret >= 0) ret = Rec->Recognize(1.2, &params);
+			if (ret > 0) n_faces += ret;
+			if (!quiet) printf("%s: %d\n", filenames[i], ret);
+		}
+		double t = now()-t0;
+		printf("%d images, %lld faces, %.1f ms, %.2f images/s\n", n, n_faces, t*1000, t > 0 ? n/t : 0.0);
+		delete Rec;
+		return 0;
+	}
+
+	TFaceBatch *Batch = new TFaceBatch();
+	if (Batch->LoadCascadeXML(filename_i_txt) < 0) {
+		printf("failed to load '%s'\n", filename_i_txt);
+		return -1;
+	}
+	Batch->SetThreads(n_decode, n_build, n_detect);
+	if (Batch->Run(filenames, n, 1.2, &params) < 0) {
+		printf("batch failed\n");
+		return -1;
+	}
+
+	if (!quiet) {
+		for (int i = 0; i < Batch->GetImageCount(); i++) {
+			const TBatchImage *im = Batch->GetImage(i);
+			if (im->status < 0) {
+				printf("%s: failed\n", im->filename);
+				continue;
+			}
+			printf("%s: %d x %d, %d", im->filename, im->w, im->h, im->n_faces);
+			for (int k = 0; k < im->n_faces; k++) {
+				printf(" [%d %d %d %d]", im->faces[k].x1, im->faces[k].y1, im->faces[k].x2, im->faces[k].y2);
+			}
+			printf("\n");
+		}
+	}
+
+	const TBatchStats *s = Batch->GetStats();
+	printf("%d images (%d failed), %lld faces, %.1f ms, %.2f images/s; decode %.1f, build %.1f, detect %.1f ms\n",
+			s->n_images, s->n_failed, s->n_faces, s->t_total*1000,
+			s->t_total > 0 ? s->n_images/s->t_total : 0.0,
+			s->t_decode*1000, s->t_build*1000, s->t_detect*1000);
+
+	delete Batch;
+
+	return 0;
+}
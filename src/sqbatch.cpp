@@ -0,0 +1,569 @@
+/*
+    sqface - реализация алгоритма распознавания по методу Виолы-Джонса
+    Пакетная обработка: этапы на своих потоках
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "sqface_config.h"
+
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_LIBPTHREAD) && defined(HAVE_SYNC_BUILTINS)
+#define SQFACE_THREADS
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "sqbatch.h"
+
+#ifdef SQFACE_DEBUG
+#define sqface_debug(...) printf(__VA_ARGS__)
+#else
+#define sqface_debug(...)
+#endif
+
+#define max(a,b) ((a)>=(b)?(a):(b))
+
+static double now() /* {{{ */
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec/1e6;
+}
+/* }}} */
+
+// Ограниченная очередь без блокировок для нескольких писателей и читателей:
+// кольцо ячеек с номерами - ячейка pos свободна для записи, когда ее номер
+// pos, и заполнена, когда pos+1 (D. Vyukov, bounded MPMC queue)
+class TBatchQueue {
+private:
+  struct TCell {
+    volatile unsigned long seq;
+    void *data;
+  };
+  TCell *cells;
+  unsigned long mask;
+  char pad0[SQFACE_WS_ALIGN]; // head и tail - на разных строках кэша
+  volatile unsigned long head; // следующая для Pop()
+  char pad1[SQFACE_WS_ALIGN];
+  volatile unsigned long tail; // следующая для Push()
+  char pad2[SQFACE_WS_ALIGN];
+
+public:
+  TBatchQueue(int size);
+  ~TBatchQueue();
+  int Push(void *p); // -1 - полна
+  void *Pop(); // NULL - пуста
+  int Put(void *p, const volatile int *abort); // ждать места (-1 - *abort)
+  void *Get(const volatile int *abort); // ждать элемента (NULL - *abort)
+};
+
+TBatchQueue::TBatchQueue(int size) /* {{{ */
+{
+	unsigned long n = 2;
+	while (n < (unsigned long)size) n <<= 1;
+	cells = new TCell[n];
+	for (unsigned long i = 0; i < n; i++) {
+		cells[i].seq = i;
+		cells[i].data = NULL;
+	}
+	mask = n-1;
+	head = 0;
+	tail = 0;
+}
+/* }}} */
+
+TBatchQueue::~TBatchQueue() /* {{{ */
+{
+	delete[] cells;
+}
+/* }}} */
+
+#ifdef SQFACE_THREADS
+
+int TBatchQueue::Push(void *p) /* {{{ */
+{
+	for (;;) {
+		unsigned long pos = tail;
+		TCell *c = &cells[pos & mask];
+		long diff = (long)c->seq - (long)pos;
+		if (diff == 0) {
+			if (__sync_bool_compare_and_swap(&tail, pos, pos+1)) {
+				c->data = p;
+				__sync_synchronize(); // данные - раньше номера
+				c->seq = pos+1;
+				return 0;
+			}
+		} else if (diff < 0) {
+			return -1; // читатели еще не освободили ячейку
+		}
+	}
+}
+/* }}} */
+
+void *TBatchQueue::Pop() /* {{{ */
+{
+	for (;;) {
+		unsigned long pos = head;
+		TCell *c = &cells[pos & mask];
+		long diff = (long)c->seq - (long)(pos+1);
+		if (diff == 0) {
+			if (__sync_bool_compare_and_swap(&head, pos, pos+1)) {
+				void *p = c->data;
+				__sync_synchronize(); // прочитать - раньше, чем отдать ячейку писателям
+				c->seq = pos+mask+1;
+				return p;
+			}
+		} else if (diff < 0) {
+			return NULL;
+		}
+	}
+}
+/* }}} */
+
+// Ждать: сначала крутиться, потом уступать процессор, потом спать -
+// этапы неравномерны, и ожидающие не должны отнимать время у работающих
+static void backoff(int *spins) /* {{{ */
+{
+	int n = (*spins)++;
+	if (n < 64) return;
+	if (n < 256) {
+		sched_yield();
+		return;
+	}
+	usleep(100);
+}
+/* }}} */
+
+int TBatchQueue::Put(void *p, const volatile int *abort) /* {{{ */
+{
+	int spins = 0;
+	while (Push(p) < 0) {
+		if (*abort) return -1;
+		backoff(&spins);
+	}
+	return 0;
+}
+/* }}} */
+
+void *TBatchQueue::Get(const volatile int *abort) /* {{{ */
+{
+	int spins = 0;
+	void *p;
+	while (!(p = Pop())) {
+		if (*abort) return NULL;
+		backoff(&spins);
+	}
+	return p;
+}
+/* }}} */
+
+#else
+
+// Без потоков - обычное кольцо
+int TBatchQueue::Push(void *p) /* {{{ */
+{
+	if (tail-head > mask) return -1;
+	cells[tail++ & mask].data = p;
+	return 0;
+}
+/* }}} */
+
+void *TBatchQueue::Pop() /* {{{ */
+{
+	if (head == tail) return NULL;
+	return cells[head++ & mask].data;
+}
+/* }}} */
+
+int TBatchQueue::Put(void *p, const volatile int *abort) /* {{{ */
+{
+	(void)abort;
+	return Push(p);
+}
+/* }}} */
+
+void *TBatchQueue::Get(const volatile int *abort) /* {{{ */
+{
+	(void)abort;
+	return Pop();
+}
+/* }}} */
+
+#endif
+
+TFaceBatch::TFaceBatch() /* {{{ */
+{
+	filename_i_txt = NULL;
+	n_decode = n_build = n_detect = 0;
+	load_flags = 0;
+	factor = 1.2;
+	recs = NULL;
+	n_recs = 0;
+	images = NULL;
+	order = NULL;
+	n_images = 0;
+	memset(&stats, 0, sizeof(stats));
+	decoded = built = free_recs = NULL;
+	i_next = n_to_build = n_to_detect = 0;
+	abort_run = 0;
+}
+/* }}} */
+
+TFaceBatch::~TFaceBatch() /* {{{ */
+{
+	FreeImages();
+	for (int i = 0; i < n_recs; i++) delete recs[i];
+	delete[] recs;
+	free(filename_i_txt);
+}
+/* }}} */
+
+// Каскад запоминается и загружается в каждый распознаватель (сразу - в
+// уже созданные, чтобы ошибка была видна здесь)
+int TFaceBatch::LoadCascadeXML(const char *filename_i) /* {{{ */
+{
+	for (int i = 0; i < n_recs; i++) {
+		if (recs[i]->LoadCascadeXML(filename_i) < 0) return -1;
+	}
+	if (n_recs == 0) {
+		TFaceRecognizer rec;
+		if (rec.LoadCascadeXML(filename_i) < 0) return -1;
+	}
+	free(filename_i_txt);
+	filename_i_txt = strdup(filename_i);
+	return filename_i_txt ? 0 : -1;
+}
+/* }}} */
+
+void TFaceBatch::SetThreads(int n_decode, int n_build, int n_detect) /* {{{ */
+{
+	this->n_decode = n_decode;
+	this->n_build = n_build;
+	this->n_detect = n_detect;
+}
+/* }}} */
+
+// Распознавателей - не меньше n (созданные остаются на следующие Run())
+int TFaceBatch::PrepareRecognizers(int n) /* {{{ */
+{
+	if (n <= n_recs) return 0;
+	TFaceRecognizer **r = new TFaceRecognizer *[n];
+	for (int i = 0; i < n_recs; i++) r[i] = recs[i];
+	delete[] recs;
+	recs = r;
+	for (; n_recs < n; n_recs++) {
+		recs[n_recs] = new TFaceRecognizer();
+		if (recs[n_recs]->LoadCascadeXML(filename_i_txt) < 0) {
+			delete recs[n_recs];
+			sqface_debug("failed to load cascade '%s'\n", filename_i_txt);
+			return -1;
+		}
+	}
+	return 0;
+}
+/* }}} */
+
+void TFaceBatch::FreeImages() /* {{{ */
+{
+	for (int i = 0; i < n_images; i++) {
+		free(images[i].faces);
+		if (images[i].dib) FreeImage_Unload(images[i].dib);
+	}
+	delete[] images;
+	delete[] order;
+	images = NULL;
+	order = NULL;
+	n_images = 0;
+}
+/* }}} */
+
+// Этап 1: декодировать файл
+void TFaceBatch::Decode(TBatchImage *im) /* {{{ */
+{
+	// режим декодера - от тех же load_flags, что получит LoadBitmap()
+	im->dib = TFaceRecognizer::DecodeImage(im->filename, load_flags);
+	if (!im->dib) im->status = -1;
+}
+/* }}} */
+
+// Этап 2: "серая" картинка и матрицы - в распознаватель im->rec
+void TFaceBatch::Build(TBatchImage *im) /* {{{ */
+{
+	FIBITMAP *dib = im->dib;
+	im->dib = NULL; // теперь - у распознавателя
+	if (im->rec->LoadBitmap(dib, load_flags) < 0) {
+		im->status = -1;
+		return;
+	}
+	im->w = im->rec->GetImageWidth();
+	im->h = im->rec->GetImageHeight();
+}
+/* }}} */
+
+// Этап 3: распознать и забрать лица
+void TFaceBatch::Detect(TBatchImage *im) /* {{{ */
+{
+	int n = im->rec->Recognize(factor, &params);
+	if (n < 0) {
+		im->status = -1;
+		return;
+	}
+	if (n > 0) {
+		im->faces = (TFace *)malloc(n*sizeof(TFace));
+		if (!im->faces) {
+			im->status = -1;
+			return;
+		}
+		for (int i = 0; i < n; i++) im->faces[i] = *im->rec->GetFace(i);
+	}
+	im->n_faces = n;
+	im->rec->UnloadImage();
+}
+/* }}} */
+
+#ifdef SQFACE_THREADS
+
+typedef struct {
+	TFaceBatch *batch;
+	double t; // время работы (без ожидания очередей)
+} TBatchThread;
+
+void *TFaceBatch::DecodeThread(void *arg) /* {{{ */
+{
+	TBatchThread *th = (TBatchThread *)arg;
+	TFaceBatch *b = th->batch;
+	for (;;) {
+		int k = __sync_fetch_and_add(&b->i_next, 1);
+		if (k >= b->n_images) break;
+		TBatchImage *im = &b->images[b->order[k]];
+		double t = now();
+		b->Decode(im);
+		th->t += now()-t;
+		// и неудачные - следующие этапы считают картинки
+		if (b->decoded->Put(im, &b->abort_run) < 0) break;
+	}
+	return NULL;
+}
+/* }}} */
+
+void *TFaceBatch::BuildThread(void *arg) /* {{{ */
+{
+	TBatchThread *th = (TBatchThread *)arg;
+	TFaceBatch *b = th->batch;
+	while (__sync_fetch_and_sub(&b->n_to_build, 1) > 0) {
+		TBatchImage *im = (TBatchImage *)b->decoded->Get(&b->abort_run);
+		if (!im) break;
+		if (im->status == 0) {
+			im->rec = (TFaceRecognizer *)b->free_recs->Get(&b->abort_run);
+			if (!im->rec) break;
+			double t = now();
+			b->Build(im);
+			th->t += now()-t;
+		}
+		if (b->built->Put(im, &b->abort_run) < 0) break;
+	}
+	return NULL;
+}
+/* }}} */
+
+void *TFaceBatch::DetectThread(void *arg) /* {{{ */
+{
+	TBatchThread *th = (TBatchThread *)arg;
+	TFaceBatch *b = th->batch;
+	while (__sync_fetch_and_sub(&b->n_to_detect, 1) > 0) {
+		TBatchImage *im = (TBatchImage *)b->built->Get(&b->abort_run);
+		if (!im) break;
+		if (im->status == 0) {
+			double t = now();
+			b->Detect(im);
+			th->t += now()-t;
+		}
+		if (im->rec) {
+			b->free_recs->Push(im->rec); // места хватает на все
+			im->rec = NULL;
+		}
+	}
+	return NULL;
+}
+/* }}} */
+
+#endif
+
+// Номера картинок - по убыванию размера файла
+struct TBySize {
+	const TBatchImage *images;
+	bool operator()(int a, int b) const {
+		if (images[a].size != images[b].size) return images[a].size > images[b].size;
+		return a < b;
+	}
+};
+
+// Все картинки по очереди одним распознавателем (нет потоков)
+void TFaceBatch::RunSerial() /* {{{ */
+{
+	for (int k = 0; k < n_images; k++) {
+		TBatchImage *im = &images[order[k]];
+		double t = now();
+		Decode(im);
+		double t1 = now();
+		stats.t_decode += t1-t;
+		if (im->status < 0) continue;
+		im->rec = recs[0];
+		Build(im);
+		double t2 = now();
+		stats.t_build += t2-t1;
+		if (im->status == 0) Detect(im);
+		stats.t_detect += now()-t2;
+		im->rec = NULL;
+	}
+}
+/* }}} */
+
+int TFaceBatch::Run(const char * const *filenames, int n, float factor, const TRecognizeParams *params, int load_flags) /* {{{ */
+{
+	if (!filename_i_txt) {
+		sqface_debug("no cascade loaded\n");
+		return -1;
+	}
+	if (n < 0) return -1;
+
+	FreeImages();
+	images = new TBatchImage[max(n,1)];
+	order = new int[max(n,1)];
+	n_images = n;
+	memset(images, 0, max(n,1)*sizeof(TBatchImage));
+	for (int i = 0; i < n; i++) {
+		struct stat st;
+		images[i].filename = filenames[i];
+		images[i].size = stat(filenames[i], &st) == 0 ? (long long)st.st_size : 0;
+		order[i] = i;
+	}
+	// от больших файлов к маленьким (размер файла - пока картинка не
+	// декодирована, лучшая оценка числа пикселей)
+	TBySize by_size = { images };
+	std::sort(order, order+n, by_size);
+
+	this->factor = factor;
+	this->load_flags = load_flags;
+	this->params = params ? *params : TRecognizeParams();
+	memset(&stats, 0, sizeof(stats));
+	double t0 = now();
+
+	long n_cpu = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n_cpu < 1) n_cpu = 1;
+	int nd = n_decode > 0 ? n_decode : max(1, (int)n_cpu/4);
+	int nb = n_build > 0 ? n_build : 1;
+	int nr = n_detect > 0 ? n_detect : (int)n_cpu;
+
+#ifdef SQFACE_THREADS
+	// распознаватели: в работе у обоих этапов и еще по одному в очереди
+	// на каждый поток распознавания
+	int n_work = nb+2*nr;
+	if (PrepareRecognizers(n_work) < 0) return -1;
+
+	decoded = new TBatchQueue(2*nb);
+	built = new TBatchQueue(n_work);
+	free_recs = new TBatchQueue(n_work);
+	for (int i = 0; i < n_work; i++) free_recs->Push(recs[i]);
+	i_next = 0;
+	n_to_build = n;
+	n_to_detect = n;
+
+	int n_threads = nd+nb+nr;
+	pthread_t *tids = new pthread_t[n_threads];
+	TBatchThread *ths = new TBatchThread[n_threads];
+	abort_run = 0;
+	int n_started = 0;
+	for (int i = 0; i < n_threads; i++) {
+		void *(*fn)(void *) = i < nd ? DecodeThread : i < nd+nb ? BuildThread : DetectThread;
+		ths[i].batch = this;
+		ths[i].t = 0;
+		if (pthread_create(&tids[i], NULL, fn, &ths[i]) != 0) {
+			// без какого-то этапа очереди встанут - остановить все
+			sqface_debug("pthread_create failed, running serially\n");
+			abort_run = 1;
+			break;
+		}
+		n_started++;
+	}
+	for (int i = 0; i < n_started; i++) pthread_join(tids[i], NULL);
+	if (abort_run) {
+		// начать заново, по очереди
+		for (int i = 0; i < n; i++) {
+			TBatchImage *im = &images[i];
+			if (im->rec) im->rec->UnloadImage();
+			if (im->dib) FreeImage_Unload(im->dib);
+			free(im->faces);
+			im->status = 0;
+			im->n_faces = 0;
+			im->faces = NULL;
+			im->dib = NULL;
+			im->rec = NULL;
+		}
+		RunSerial();
+	} else {
+		for (int i = 0; i < n_threads; i++) {
+			if (i < nd) stats.t_decode += ths[i].t;
+			else if (i < nd+nb) stats.t_build += ths[i].t;
+			else stats.t_detect += ths[i].t;
+		}
+	}
+	delete[] tids;
+	delete[] ths;
+	delete decoded;
+	delete built;
+	delete free_recs;
+	decoded = built = free_recs = NULL;
+#else
+	if (PrepareRecognizers(1) < 0) return -1;
+	RunSerial();
+	(void)nd;
+	(void)nb;
+	(void)nr;
+#endif
+
+	stats.t_total = now()-t0;
+	stats.n_images = n;
+	for (int i = 0; i < n; i++) {
+		if (images[i].status < 0) stats.n_failed++;
+		else stats.n_faces += images[i].n_faces;
+	}
+	return n-stats.n_failed;
+}
+/* }}} */
+
+int TFaceBatch::GetImageCount() /* {{{ */
+{
+	return n_images;
+}
+/* }}} */
+
+const TBatchImage *TFaceBatch::GetImage(int i) /* {{{ */
+{
+	if (i < 0 || i >= n_images) return NULL;
+	return &images[i];
+}
+/* }}} */
+
+const TBatchStats *TFaceBatch::GetStats() /* {{{ */
+{
+	return &stats;
+}
+/* }}} */
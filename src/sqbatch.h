@@ -0,0 +1,86 @@
+#ifndef SQBATCH_H
+#define SQBATCH_H
+
+#include "sqface.h"
+
+// Картинка пакета: результат (после Run())
+typedef struct {
+  const char *filename;
+  long long size; // байт в файле - чем больше, тем раньше в работу
+  int status;     // 0 - распознана, < 0 - не загрузилась
+  int w, h;
+  int n_faces;
+  TFace *faces;
+  // между этапами
+  FIBITMAP *dib;
+  TFaceRecognizer *rec;
+} TBatchImage;
+
+// Счетчики последнего Run()
+typedef struct {
+  int n_images;
+  int n_failed;
+  long long n_faces;
+  double t_total;  // секунд на весь пакет
+  double t_decode; // ... и по этапам, сумма по потокам
+  double t_build;
+  double t_detect;
+} TBatchStats;
+
+class TBatchQueue;
+
+// Пакет картинок: декодирование (FreeImage_Load()), "серая" картинка с
+// интегральными матрицами и Recognize() - отдельные этапы, каждый на своих
+// потоках, между ними - ограниченные очереди без блокировок. Распознаватели
+// (со своими рабочими областями) ходят по кругу: свободные -> матрицы ->
+// распознавание -> свободные. Картинки берутся от больших файлов к маленьким,
+// чтобы в конце не ждать одну большую. Без потоков (нет pthread или
+// __sync_*) - то же по очереди в одном
+class TFaceBatch {
+private:
+  char *filename_i_txt;
+  int n_decode, n_build, n_detect; // потоков на этап
+  int load_flags;
+  float factor;
+  TRecognizeParams params;
+
+  TFaceRecognizer **recs;
+  int n_recs;
+
+  TBatchImage *images;
+  int *order; // номера картинок, от больших файлов к маленьким
+  int n_images;
+  TBatchStats stats;
+
+  // общие для потоков Run()
+  TBatchQueue *decoded;  // декодированные картинки
+  TBatchQueue *built;    // ... с матрицами в распознавателе
+  TBatchQueue *free_recs;
+  volatile int i_next;       // следующая картинка для декодирования
+  volatile int n_to_build;   // сколько еще взять этапу матриц
+  volatile int n_to_detect;  // ... и распознавания
+  volatile int abort_run;    // потоки не запустились - всем выйти
+
+  int PrepareRecognizers(int n);
+  void FreeImages();
+  void Decode(TBatchImage *im);
+  void Build(TBatchImage *im);
+  void Detect(TBatchImage *im);
+  void RunSerial();
+  static void *DecodeThread(void *arg);
+  static void *BuildThread(void *arg);
+  static void *DetectThread(void *arg);
+
+public:
+  TFaceBatch();
+  ~TFaceBatch();
+  int LoadCascadeXML(const char *filename_i); // Каскад для всех распознавателей
+  void SetThreads(int n_decode, int n_build, int n_detect); // <= 0 - по числу процессоров
+  // Распознать лица на всех картинках; вернуть, сколько загрузилось
+  int Run(const char * const *filenames, int n, float factor, const TRecognizeParams *params = NULL, int load_flags = 0);
+  int GetImageCount();
+  const TBatchImage *GetImage(int i); // в порядке filenames
+  const TBatchStats *GetStats();
+};
+
+#endif
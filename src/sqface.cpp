@@ -33,6 +33,19 @@
 #include <vector>
 #include <string.h>
 
+#include "sqface_config.h"
+
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define SQFACE_NEON 1
+#endif
+
 #include "rapidxml.hpp"
 #include "rapidxml_print.hpp"
 
@@ -41,7 +54,6 @@ using namespace rapidxml;
 
 #include "sqface.h"
 #include "sqface_version.h"
-#include "sqface_config.h"
 
 #define max(a,b) ((a)>=(b)?(a):(b))
 #define min(a,b) ((a)<(b)?(a):(b))
@@ -79,6 +91,35 @@ inline SUM_TYPE TFaceRecognizer::f_sum1(int x_s, int y_s, int w_r_scaled, int h_
 }
 /* }}} */
 
+// Сумма по p2 или по сжатой матрице (для редких вызовов, не в каскаде)
+inline SUM_TYPE TFaceRecognizer::w_sum1(int x_s, int y_s, int w_r_scaled, int h_r_scaled) /* {{{ */
+{
+	return p2 ? f_sum1(x_s,y_s,w_r_scaled,h_r_scaled) : c_sum1(x_s,y_s,w_r_scaled,h_r_scaled);
+}
+/* }}} */
+
+// Точка сжатой матрицы: два лишних сложения
+inline SUM_TYPE TFaceRecognizer::c_at(int x, int y) /* {{{ */
+{
+	return c_left[n_bx*y + (x >> SQFACE_BLOCK_SHIFT)] +
+		c_top[w2*(y >> SQFACE_BLOCK_SHIFT) + x] +
+		c_local[w2*y + x];
+}
+/* }}} */
+
+inline SUM_TYPE TFaceRecognizer::c_sum1(int x_s, int y_s, int w_r_scaled, int h_r_scaled) /* {{{ */
+{
+	SUM_TYPE S4, S1 = 0, S2 = 0, S3 = 0;
+
+	S4 = c_at(x_s+w_r_scaled-1, y_s+h_r_scaled-1);
+	if (y_s > 0 && x_s > 0) S1 = c_at(x_s-1, y_s-1);
+	if (y_s > 0) S2 = c_at(x_s+w_r_scaled-1, y_s-1);
+	if (x_s > 0) S3 = c_at(x_s-1, y_s+h_r_scaled-1);
+
+	return (S4 + S1 - S2 - S3);
+}
+/* }}} */
+
 inline SUM_TYPE2 TFaceRecognizer::f_sum2(int x_s, int y_s, int w_r_scaled, int h_r_scaled) /* {{{ */
 {
 	SUM_TYPE2 S4 = -1;
@@ -95,15 +136,81 @@ inline SUM_TYPE2 TFaceRecognizer::f_sum2(int x_s, int y_s, int w_r_scaled, int h
 		S3 = 0;
 	}
 
-	S4 = p3[w2*(y_s+h_r_scaled-1) + (x_s+w_r_scaled-1)];
-	if (S1 != 0) S1 = p3[w2*(y_s+0-1) + (x_s+0-1)];
-	if (S2 != 0) S2 = p3[w2*(y_s+0-1) + (x_s+w_r_scaled-1)];
-	if (S3 != 0) S3 = p3[w2*(y_s+h_r_scaled-1) + (x_s+0-1)];
+	S4 = p3[w3*(y_s+h_r_scaled-1) + (x_s+w_r_scaled-1)];
+	if (S1 != 0) S1 = p3[w3*(y_s+0-1) + (x_s+0-1)];
+	if (S2 != 0) S2 = p3[w3*(y_s+0-1) + (x_s+w_r_scaled-1)];
+	if (S3 != 0) S3 = p3[w3*(y_s+h_r_scaled-1) + (x_s+0-1)];
+
+	return (S4 + S1 - S2 - S3);
+}
+/* }}} */
+
+// Дисперсия яркости окна (inv = 1/площадь окна). При p3 по блокам -
+// дисперсия ближайшего прямоугольника из целых блоков (среднее - по
+// нему же из p2), точная, если окно выровнено по блокам
+inline float TFaceRecognizer::WindowVariance(int x_s, int y_s, int w_r_scaled, int h_r_scaled, float inv) /* {{{ */
+{
+	if (sq_shift == 0) {
+		float mean = w_sum1(x_s,y_s,w_r_scaled,h_r_scaled)*inv;
+		return f_sum2(x_s,y_s,w_r_scaled,h_r_scaled)*inv - sqr(mean);
+	}
+
+	int half = (1 << sq_shift) >> 1;
+	int bx1 = (x_s+half) >> sq_shift;
+	int by1 = (y_s+half) >> sq_shift;
+	int bx2 = min((int)w3, (x_s+w_r_scaled+half) >> sq_shift);
+	int by2 = min((int)h3, (y_s+h_r_scaled+half) >> sq_shift);
+	if (bx1 >= bx2) bx1 = max(0, bx2-1);
+	if (by1 >= by2) by1 = max(0, by2-1);
+	int bw = bx2-bx1, bh = by2-by1;
+	if (bw <= 0 || bh <= 0) return 0;
+
+	float binv = 1/float((bw*bh) << (2*sq_shift));
+	float mean = w_sum1(bx1 << sq_shift, by1 << sq_shift, bw << sq_shift, bh << sq_shift)*binv;
+	return f_sum2(bx1,by1,bw,bh)*binv - sqr(mean);
+}
+/* }}} */
+
+inline unsigned int TFaceRecognizer::e_sum(int x_s, int y_s, int w_r_scaled, int h_r_scaled) /* {{{ */
+{
+	unsigned int S4, S1 = 0, S2 = 0, S3 = 0;
+
+	S4 = p4[w4*(y_s+h_r_scaled-1) + (x_s+w_r_scaled-1)];
+	if (y_s > 0 && x_s > 0) S1 = p4[w4*(y_s+0-1) + (x_s+0-1)];
+	if (y_s > 0) S2 = p4[w4*(y_s+0-1) + (x_s+w_r_scaled-1)];
+	if (x_s > 0) S3 = p4[w4*(y_s+h_r_scaled-1) + (x_s+0-1)];
+
+	return (S4 + S1 - S2 - S3);
+}
+/* }}} */
+
+inline unsigned int TFaceRecognizer::k_sum(int x_s, int y_s, int w_r_scaled, int h_r_scaled) /* {{{ */
+{
+	unsigned int S4, S1 = 0, S2 = 0, S3 = 0;
+
+	S4 = p5[w5*(y_s+h_r_scaled-1) + (x_s+w_r_scaled-1)];
+	if (y_s > 0 && x_s > 0) S1 = p5[w5*(y_s+0-1) + (x_s+0-1)];
+	if (y_s > 0) S2 = p5[w5*(y_s+0-1) + (x_s+w_r_scaled-1)];
+	if (x_s > 0) S3 = p5[w5*(y_s+h_r_scaled-1) + (x_s+0-1)];
 
 	return (S4 + S1 - S2 - S3);
 }
 /* }}} */
 
+// Сумма повернутого прямоугольника (смещения как CV_TILTED_OFFSETS OpenCV):
+// p0 = (x,y), p1 = (x-h,y+h), p2 = (x+w,y+w), p3 = (x+w-h,y+w+h)
+inline int TFaceRecognizer::t_sum(int x_s, int y_s, int w_r_scaled, int h_r_scaled) /* {{{ */
+{
+	const unsigned int *t = p6 + w6*y_s + x_s;
+	unsigned int S0 = t[0];
+	unsigned int S1 = t[w6*h_r_scaled - h_r_scaled];
+	unsigned int S2 = t[w6*w_r_scaled + w_r_scaled];
+	unsigned int S3 = t[w6*(w_r_scaled+h_r_scaled) + w_r_scaled - h_r_scaled];
+
+	return (int)(S0 - S1 - S2 + S3);
+}
+/* }}} */
+
 inline SUM_TYPE TFaceRecognizer::s_sum1(int x_s, int y_s, int w_r_scaled, int h_r_scaled) /* {{{ */
 {
 	SUM_TYPE S = 0;
@@ -158,9 +265,292 @@ void FreeImageErrorHandler(FREE_IMAGE_FORMAT fif, const char *message) /* {{{ */
 }
 /* }}} */
 
+// Рабочая область
+TFaceWorkspace::TFaceWorkspace(size_t arena_size, int flags) /* {{{ */
+{
+	for (int i = 0; i < SQFACE_WS_MAX; i++) {
+		bufs[i] = NULL;
+		sizes[i] = 0;
+		mapped[i] = 0;
+		locked[i] = 0;
+		in_arena[i] = 0;
+	}
+	n_allocs = 0;
+	owner = NULL;
+	this->flags = flags;
+	this->arena = NULL;
+	this->arena_size = 0;
+	this->arena_used = 0;
+	this->arena_mapped = 0;
+	this->arena_locked = 0;
+
+	if (arena_size > 0) {
+		this->arena = (BYTE *)Alloc(arena_size, &this->arena_mapped, &this->arena_locked);
+		if (this->arena) {
+			this->arena_size = arena_size;
+		} else {
+			sqface_debug("failed to allocate %lu bytes arena\n", (unsigned long)arena_size);
+		}
+	}
+}
+/* }}} */
+
+TFaceWorkspace::~TFaceWorkspace() /* {{{ */
+{
+	for (int i = 0; i < SQFACE_WS_MAX; i++) {
+		if (bufs[i] && !in_arena[i]) Free(bufs[i], mapped[i], locked[i]);
+	}
+	if (arena) Free(arena, arena_mapped, arena_locked);
+}
+/* }}} */
+
+// Выделить size байт, выровненных на SQFACE_WS_ALIGN;
+// *mapped > 0 - размер отображения, если память получена через mmap();
+// *locked > 0 - сколько байт из кучи под mlock() (munmap() отпускает сам, free() - нет)
+void *TFaceWorkspace::Alloc(size_t size, size_t *mapped, size_t *locked) /* {{{ */
+{
+	void *ptr = NULL;
+	n_allocs++;
+	*mapped = 0;
+	*locked = 0;
+
+#ifdef HAVE_SYS_MMAN_H
+	if ((flags & (SQFACE_WS_HUGETLB | SQFACE_WS_THP)) && size >= SQFACE_HUGEPAGE_SIZE) {
+		size_t len = (size + SQFACE_HUGEPAGE_SIZE - 1) & ~((size_t)SQFACE_HUGEPAGE_SIZE - 1);
+
+#ifdef MAP_HUGETLB
+		// явные huge pages (vm.nr_hugepages), если не зарезервированы - дальше THP
+		if (flags & SQFACE_WS_HUGETLB) {
+			ptr = mmap(NULL, len, PROT_READ | PROT_WRITE,
+					MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+			if (ptr == MAP_FAILED) {
+				sqface_debug("MAP_HUGETLB failed for %lu bytes, falling back\n", (unsigned long)len);
+				ptr = NULL;
+			}
+		}
+#endif
+		if (!ptr) {
+			// с запасом, чтобы выровнять начало на 2 Мб, иначе ядро не даст huge page
+			size_t len_pad = len + SQFACE_HUGEPAGE_SIZE;
+			BYTE *raw = (BYTE *)mmap(NULL, len_pad, PROT_READ | PROT_WRITE,
+					MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (raw != MAP_FAILED) {
+				BYTE *aligned = (BYTE *)(((size_t)raw + SQFACE_HUGEPAGE_SIZE - 1) & ~((size_t)SQFACE_HUGEPAGE_SIZE - 1));
+				if (aligned > raw) munmap(raw, aligned - raw);
+				if (raw + len_pad > aligned + len) munmap(aligned + len, raw + len_pad - (aligned + len));
+				ptr = aligned;
+#if defined(HAVE_MADVISE) && defined(MADV_HUGEPAGE)
+				if (madvise(ptr, len, MADV_HUGEPAGE) != 0) {
+					sqface_debug("madvise(MADV_HUGEPAGE) failed\n");
+				}
+#endif
+			} else {
+				ptr = NULL;
+			}
+		}
+
+		if (ptr) {
+			*mapped = len;
+			if (flags & SQFACE_WS_PREFAULT) {
+				// первое касание сейчас, а не в Recognize()
+				for (size_t i = 0; i < len; i += 4096) ((BYTE *)ptr)[i] = 0;
+			}
+#ifdef HAVE_MLOCK
+			if ((flags & SQFACE_WS_MLOCK) && mlock(ptr, len) != 0) {
+				sqface_debug("mlock() failed for %lu bytes\n", (unsigned long)len);
+			}
+#endif
+			return ptr;
+		}
+	}
+#endif
+
+#ifdef HAVE_POSIX_MEMALIGN
+	if (flags & SQFACE_WS_MLOCK) {
+		// целые свои страницы: munlock() не отпустит чужие из тех же страниц
+		size = (size + SQFACE_PAGE_SIZE - 1) & ~((size_t)SQFACE_PAGE_SIZE - 1);
+		if (posix_memalign(&ptr, SQFACE_PAGE_SIZE, size) != 0) return NULL;
+	} else {
+		if (posix_memalign(&ptr, SQFACE_WS_ALIGN, size) != 0) return NULL;
+	}
+#else
+	ptr = malloc(size);
+	if (!ptr) return NULL;
+#endif
+	if (flags & SQFACE_WS_PREFAULT) memset(ptr, 0, size);
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MLOCK)
+	if (flags & SQFACE_WS_MLOCK) {
+		if (mlock(ptr, size) == 0) {
+			*locked = size;
+		} else {
+			sqface_debug("mlock() failed for %lu bytes\n", (unsigned long)size);
+		}
+	}
+#endif
+	return ptr;
+}
+/* }}} */
+
+void TFaceWorkspace::Free(void *ptr, size_t mapped, size_t locked) /* {{{ */
+{
+#ifdef HAVE_SYS_MMAN_H
+	if (mapped > 0) {
+		munmap(ptr, mapped);
+		return;
+	}
+#ifdef HAVE_MLOCK
+	// страницы вернутся в кучу - иначе так и останутся запертыми (и в RLIMIT_MEMLOCK)
+	if (locked > 0) munlock(ptr, locked);
+#endif
+#endif
+	free(ptr);
+}
+/* }}} */
+
+// Выдать буфер слота не меньше size байт; содержимое при росте не сохраняется
+void *TFaceWorkspace::Reserve(int slot, size_t size) /* {{{ */
+{
+	if (slot < 0 || slot >= SQFACE_WS_MAX) return NULL;
+	if (size <= sizes[slot] && bufs[slot]) return bufs[slot];
+
+	if (bufs[slot] && !in_arena[slot]) Free(bufs[slot], mapped[slot], locked[slot]);
+	bufs[slot] = NULL;
+	sizes[slot] = 0;
+	mapped[slot] = 0;
+	locked[slot] = 0;
+	in_arena[slot] = 0;
+
+	// сначала из арены (она не освобождается по частям: вырос - старый кусок пропал)
+	size_t offset = (arena_used + SQFACE_WS_ALIGN - 1) & ~((size_t)SQFACE_WS_ALIGN - 1);
+	if (arena && offset + size <= arena_size) {
+		bufs[slot] = arena + offset;
+		arena_used = offset + size;
+		in_arena[slot] = 1;
+	} else {
+		bufs[slot] = Alloc(size, &mapped[slot], &locked[slot]);
+		if (!bufs[slot]) {
+			sqface_debug("failed to allocate %lu bytes\n", (unsigned long)size);
+			return NULL;
+		}
+	}
+	sizes[slot] = size;
+	return bufs[slot];
+}
+/* }}} */
+
+// Увеличить буфер слота до size байт, сохранив содержимое
+void *TFaceWorkspace::Grow(int slot, size_t size) /* {{{ */
+{
+	if (slot < 0 || slot >= SQFACE_WS_MAX) return NULL;
+	if (size <= sizes[slot] && bufs[slot]) return bufs[slot];
+
+	void *old = bufs[slot];
+	size_t old_size = sizes[slot];
+	size_t old_mapped = mapped[slot];
+	size_t old_locked = locked[slot];
+	int old_in_arena = in_arena[slot];
+
+	// Reserve() освободит старый буфер - не дать ему этого сделать
+	bufs[slot] = NULL;
+	sizes[slot] = 0;
+	if (!Reserve(slot, size)) {
+		bufs[slot] = old;
+		sizes[slot] = old_size;
+		mapped[slot] = old_mapped;
+		locked[slot] = old_locked;
+		in_arena[slot] = old_in_arena;
+		return NULL;
+	}
+	if (old) {
+		memcpy(bufs[slot], old, old_size);
+		if (!old_in_arena) Free(old, old_mapped, old_locked);
+	}
+	return bufs[slot];
+}
+/* }}} */
+
+size_t TFaceWorkspace::GetSize() /* {{{ */
+{
+	size_t total = arena_mapped ? arena_mapped : arena_size;
+	for (int i = 0; i < SQFACE_WS_MAX; i++) {
+		if (!in_arena[i]) total += mapped[i] ? mapped[i] : sizes[i];
+	}
+	return total;
+}
+/* }}} */
+
+int TFaceWorkspace::GetAllocCount() /* {{{ */
+{
+	return n_allocs;
+}
+/* }}} */
+
+void *TFaceWorkspace::Get(int slot, size_t *size) /* {{{ */
+{
+	if (slot < 0 || slot >= SQFACE_WS_MAX) return NULL;
+	if (size) *size = bufs[slot] ? sizes[slot] : 0;
+	return bufs[slot];
+}
+/* }}} */
+
+// Общая область: буферы слотов могли переехать и перезаписаться другим
+int TFaceWorkspace::Claim(const void *user) /* {{{ */
+{
+	int other = owner && owner != user;
+	owner = user;
+	return other;
+}
+/* }}} */
+
 // Конструктор
 TFaceRecognizer::TFaceRecognizer() /* {{{ */
 {
+	dib0 = NULL;
+	p0 = NULL;
+	p1 = NULL;
+	p2 = NULL;
+	c_local = NULL;
+	p3 = NULL;
+	p4 = NULL;
+	p5 = NULL;
+	p6 = NULL;
+	w6 = h6 = 0;
+	sq_shift = 0;
+	sum16 = 0;
+	w0 = h0 = 0;
+	w1 = h1 = 0;
+	ws = new TFaceWorkspace();
+	ws_own = 1;
+	faces = NULL;
+	n_faces = 0;
+	max_faces = 0;
+	stop = 0;
+	skip_parts = 0;
+	hints = NULL;
+	n_hints = 0;
+	max_hints = 0;
+	record_hints = 0;
+	xs_prev = NULL;
+	xs_cur = NULL;
+	groups = NULL;
+	margins = NULL;
+	result = NULL;
+	n_result = 0;
+	n_cascades = 0;
+	n_margins = 0;
+	n_scan = 0;
+	scan_lbp = 0;
+	parts = NULL;
+	n_parts = 0;
+	max_parts = 0;
+	n_tracked = 0;
+	n_frames = 0;
+	ch_map = NULL;
+	ch_sum = NULL;
+	n_chx = n_chy = 0;
+	n_changed = -1;
+	n_cached = -1;
+	scan_changed = 0;
 	FreeImage_Initialise(1);
 	FreeImage_SetOutputMessage(FreeImageErrorHandler);
 }
@@ -170,89 +560,364 @@ TFaceRecognizer::TFaceRecognizer() /* {{{ */
 TFaceRecognizer::~TFaceRecognizer() /* {{{ */
 {
   UnloadImage(); // на всякий случай
+  if (ws_own) delete ws;
   FreeImage_DeInitialise();
 }
 /* }}} */
 
-// Загрузить изображение, и пред-обработать
-int TFaceRecognizer::LoadImage(const char *filename_i) /* {{{ */
+// Использовать внешнюю рабочую область (NULL - своя)
+void TFaceRecognizer::SetWorkspace(TFaceWorkspace *workspace) /* {{{ */
+{
+	UnloadImage(); // таблицы живут в старой области
+	faces = NULL;
+	n_faces = 0;
+	max_faces = 0;
+	hints = NULL;
+	n_hints = 0;
+	max_hints = 0;
+	xs_prev = NULL;
+	xs_cur = NULL;
+	groups = NULL;
+	margins = NULL;
+	result = NULL;
+	n_result = 0;
+	parts = NULL;
+	n_parts = 0;
+	max_parts = 0;
+
+	if (ws_own) delete ws;
+	if (workspace) {
+		ws = workspace;
+		ws_own = 0;
+	} else {
+		ws = new TFaceWorkspace();
+		ws_own = 1;
+	}
+}
+/* }}} */
+
+// Перед работой с областью: если после нас ею пользовался другой
+// распознаватель - наших картинки, окон и результатов в ней больше нет
+void TFaceRecognizer::ClaimWorkspace() /* {{{ */
+{
+	if (!ws->Claim(this)) return;
+	UnloadImage();
+	faces = NULL;
+	n_faces = 0;
+	max_faces = 0;
+	hints = NULL;
+	n_hints = 0;
+	max_hints = 0;
+	xs_prev = NULL;
+	xs_cur = NULL;
+	groups = NULL;
+	margins = NULL;
+	result = NULL;
+	n_result = 0;
+	parts = NULL;
+	n_parts = 0;
+	max_parts = 0;
+	ch_map = NULL;
+	ch_sum = NULL;
+}
+/* }}} */
+
+// Декодировать файл для LoadBitmap(): единственное место, где flags
+// выбирают режим декодера
+FIBITMAP *TFaceRecognizer::DecodeImage(const char *filename_i, int flags) /* {{{ */
 {
 	FREE_IMAGE_FORMAT fif;
+	FIBITMAP *dib;
 
 	fif = FreeImage_GetFIFFromFilename(filename_i);
 	if (fif == FIF_UNKNOWN) {
 		sqface_debug("failed to read file signature from '%s'\n", filename_i);
-		return -1;
+		return NULL;
 	}
 
 	if (!FreeImage_FIFSupportsReading(fif)) {
 		sqface_debug("FreeImage library cannot read this type of files '%s'\n", filename_i);
+		return NULL;
+	}
+
+	// Только яркость: JPEG-декодер сразу отдает Y-плоскость,
+	// без upsampling'а цветности и преобразования в RGB
+	dib = FreeImage_Load(fif, filename_i, (flags & SQFACE_LOAD_GRAY) ? JPEG_ACCURATE | JPEG_GREYSCALE : JPEG_ACCURATE);
+	if (!dib) sqface_debug("failed to load '%s'\n", filename_i);
+	return dib;
+}
+/* }}} */
+
+// Загрузить изображение, и пред-обработать
+int TFaceRecognizer::LoadImage(const char *filename_i, int flags) /* {{{ */
+{
+	UnloadImage(); // предыдущая картинка
+
+	FIBITMAP *dib = DecodeImage(filename_i, flags);
+	if (!dib) return -1;
+	return LoadBitmap(dib, flags);
+}
+/* }}} */
+
+// Загрузить уже декодированную картинку (FreeImage_Load() в другом потоке
+// и т.п.); dib переходит распознавателю. С SQFACE_LOAD_GRAY "цветной"
+// картинки нет, рисовать и сохранять нечего - dib сразу освобождается
+int TFaceRecognizer::LoadBitmap(FIBITMAP *dib, int flags) /* {{{ */
+{
+	if (!dib) return -1;
+	ClaimWorkspace();
+	UnloadImage(); // предыдущая картинка
+
+	if (flags & SQFACE_LOAD_GRAY) {
+		w0 = FreeImage_GetWidth(dib);
+		h0 = FreeImage_GetHeight(dib);
+		p0 = NULL;
+		bpp0 = 0;
+		bypp0 = 0;
+		stride0 = 0;
+
+		int ret = ConvertGray(dib);
+		FreeImage_Unload(dib);
+		if (ret < 0) return -1;
+	} else {
+		// Оригинальное "цветное" изображение
+		dib0 = dib;
+		w0 = FreeImage_GetWidth(dib0);
+		h0 = FreeImage_GetHeight(dib0);
+		p0 = FreeImage_GetBits(dib0);
+		bpp0 = FreeImage_GetBPP(dib0);
+		bypp0 = bpp0/8;
+		stride0 = FreeImage_GetPitch(dib0); // что такое Pitch?
+
+		if (ConvertGray(dib0) < 0) return -1;
+	}
+
+	sum16 = (flags & SQFACE_LOAD_SUM16) ? 1 : 0;
+	sq_shift = 0;
+	if (flags & SQFACE_LOAD_SQSUM_HALF) sq_shift = 1;
+	if (flags & SQFACE_LOAD_SQSUM_QUARTER) sq_shift = 2;
+	return BuildIntegrals();
+}
+/* }}} */
+
+// Загрузить готовую яркость (Y-плоскость кадра из видео, камеры и т.п.)
+// без FreeImage: копируется в рабочую область, как после ConvertGray();
+// "цветной" картинки нет, как с SQFACE_LOAD_GRAY
+int TFaceRecognizer::LoadGray(const BYTE *src, int w, int h, int stride, int flags) /* {{{ */
+{
+	if (!src || w <= 0 || h <= 0 || w > 0xFFFF || h > 0xFFFF || stride < w) {
+		sqface_debug("invalid gray plane %dx%d, stride %d\n", w, h, stride);
 		return -1;
 	}
 
-	// Оригинальное "цветное" изображение
-	// , увеличить
-	dib0 = FreeImage_Load(fif, filename_i, JPEG_ACCURATE);
+	ClaimWorkspace();
+	UnloadImage(); // предыдущая картинка
 
-	if (!dib0) {
-		sqface_debug("failed to load '%s'\n", filename_i);
+	w0 = w;
+	h0 = h;
+	p0 = NULL;
+	bpp0 = 0;
+	bypp0 = 0;
+	stride0 = 0;
+
+	p1 = (BYTE *)ws->Reserve(SQFACE_WS_GRAY, (size_t)w*h);
+	if (!p1) {
+		sqface_debug("No free memory.\n");
 		return -1;
 	}
+	w1 = w;
+	h1 = h;
+	bpp1 = 8;
+	bypp1 = 1;
+	stride1 = w1;
+	for (int y = 0; y < h; y++) {
+		memcpy(p1 + stride1*y, src + (size_t)stride*y, w);
+	}
 
-	w0 = FreeImage_GetWidth(dib0);
-	h0 = FreeImage_GetHeight(dib0);
-	p0 = FreeImage_GetBits(dib0);
-	bpp0 = FreeImage_GetBPP(dib0);
-	bypp0 = bpp0/8;
-	stride0 = FreeImage_GetPitch(dib0); // что такое Pitch?
+	sum16 = (flags & SQFACE_LOAD_SUM16) ? 1 : 0;
+	sq_shift = 0;
+	if (flags & SQFACE_LOAD_SQSUM_HALF) sq_shift = 1;
+	if (flags & SQFACE_LOAD_SQSUM_QUARTER) sq_shift = 2;
+	return BuildIntegrals();
+}
+/* }}} */
 
-	// Оригинальное "цветное" изображение
-	// , увеличить
-	dib0 = FreeImage_Load(fif, filename_i, JPEG_ACCURATE);
+// Следующий кадр того же размера (после LoadGray() или UpdateGray()):
+// в "серую" картинку переписываются только блоки, где хоть один пиксель
+// изменился больше чем на threshold (в остальных остается прошлый кадр -
+// окна там можно не пересчитывать), матрицы пересчитываются с первой
+// измененной строки (p4..p6 - заново, по требованию). Блоки копятся до
+// следующего Recognize(). Другой размер или флаги - как LoadGray(), все
+// блоки измененные; вернуть число измененных блоков
+int TFaceRecognizer::UpdateGray(const BYTE *src, int w, int h, int stride, int flags, int threshold) /* {{{ */
+{
+	int b = 1 << SQFACE_CHANGE_SHIFT;
+	int shift = 0;
+	if (flags & SQFACE_LOAD_SQSUM_HALF) shift = 1;
+	if (flags & SQFACE_LOAD_SQSUM_QUARTER) shift = 2;
+
+	ClaimWorkspace(); // прошлый кадр мог пропасть - тогда p1 == NULL
+	if (!src || !p1 || p0 || w != w1 || h != h1 || stride < w || shift != sq_shift ||
+			((flags & SQFACE_LOAD_SUM16) ? 1 : 0) != sum16) {
+		if (LoadGray(src, w, h, stride, flags) < 0) return -1;
+		n_chx = (w+b-1) >> SQFACE_CHANGE_SHIFT;
+		n_chy = (h+b-1) >> SQFACE_CHANGE_SHIFT;
+		return n_chx*n_chy;
+	}
 
-	if (!dib0) {
-		sqface_debug("failed to load '%s'\n", filename_i);
+	int nx = (w+b-1) >> SQFACE_CHANGE_SHIFT;
+	int ny = (h+b-1) >> SQFACE_CHANGE_SHIFT;
+	size_t n_sum = (size_t)(nx+1)*(ny+1);
+	BYTE *buf = (BYTE *)ws->Reserve(SQFACE_WS_CHANGED, n_sum*sizeof(int) + (size_t)nx*ny);
+	if (!buf) {
+		sqface_debug("No free memory.\n");
 		return -1;
 	}
+	ch_sum = (int *)buf;
+	ch_map = buf + n_sum*sizeof(int);
+	if (n_changed <= 0 || nx != n_chx || ny != n_chy) memset(ch_map, 0, (size_t)nx*ny);
+	n_chx = nx;
+	n_chy = ny;
+
+	int y_first = -1, n = 0;
+	for (int by = 0; by < n_chy; by++) {
+		int y_lo = by*b, y_hi = min(h, y_lo+b);
+		for (int bx = 0; bx < n_chx; bx++) {
+			int x_lo = bx*b, x_hi = min(w, x_lo+b);
+			int changed = 0;
+			for (int y = y_lo; y < y_hi && !changed; y++) {
+				const BYTE *a = src + (size_t)stride*y + x_lo;
+				const BYTE *d = p1 + stride1*y + x_lo;
+				if (threshold <= 0) {
+					changed = memcmp(a, d, x_hi-x_lo) != 0;
+				} else {
+					for (int x = 0; x < x_hi-x_lo && !changed; x++) changed = abs(a[x]-d[x]) > threshold;
+				}
+			}
+			if (!changed) continue;
+			for (int y = y_lo; y < y_hi; y++) {
+				memcpy(p1 + stride1*y + x_lo, src + (size_t)stride*y + x_lo, x_hi-x_lo);
+			}
+			if (y_first < 0) y_first = y_lo;
+			ch_map[by*n_chx+bx] = 1;
+			n++;
+		}
+	}
+
+	// накопленные суммы по блокам - сколько измененных в прямоугольнике
+	memset(ch_sum, 0, (n_chx+1)*sizeof(int));
+	int total = 0;
+	for (int by = 0; by < n_chy; by++) {
+		const BYTE *m = ch_map + by*n_chx;
+		int *s = ch_sum + (by+1)*(n_chx+1);
+		int row = 0;
+		s[0] = 0;
+		for (int bx = 0; bx < n_chx; bx++) {
+			row += m[bx];
+			s[bx+1] = s[bx+1-(n_chx+1)] + row;
+		}
+		total += row;
+	}
+	if (n_changed >= 0) n_changed = total;
+
+	if (y_first >= 0) {
+		p4 = NULL; // по требованию - целиком
+		p5 = NULL;
+		p6 = NULL;
+		if (BuildIntegrals(sum16 ? 0 : y_first) < 0) return -1;
+	}
+	return n;
+}
+/* }}} */
 
-	w0 = FreeImage_GetWidth(dib0);
-	h0 = FreeImage_GetHeight(dib0);
-	p0 = FreeImage_GetBits(dib0);
-	bpp0 = FreeImage_GetBPP(dib0);
-	bypp0 = bpp0/8;
-	stride0 = FreeImage_GetPitch(dib0); // что такое Pitch?
-	dibo = FreeImage_Clone(dib0);
+// Перевести в градации серого в буфер рабочей области
+// (строки сверху вниз, как в интегральных матрицах)
+int TFaceRecognizer::ConvertGray(FIBITMAP *dib) /* {{{ */
+{
+	FIBITMAP *dib_grey = NULL;
+	int w = FreeImage_GetWidth(dib);
+	int h = FreeImage_GetHeight(dib);
+	int bypp = FreeImage_GetBPP(dib)/8;
+
+	if (!(bypp == 3 || bypp == 4 || (bypp == 1 && FreeImage_GetColorType(dib) == FIC_MINISBLACK))) {
+		// палитры, 16 бит и т.п. - редкий случай, пусть конвертирует FreeImage
+		dib_grey = FreeImage_ConvertToGreyscale(dib);
+		if (!dib_grey) {
+			sqface_debug("failed to convert image to greyscale\n");
+			return -1;
+		}
+		dib = dib_grey;
+		bypp = 1;
+	}
 
-	dib1 = FreeImage_ConvertToGreyscale(dib0);
-	FreeImage_FlipVertical(dib1);
+	p1 = (BYTE *)ws->Reserve(SQFACE_WS_GRAY, (size_t)w*h);
+	if (!p1) {
+		if (dib_grey) FreeImage_Unload(dib_grey);
+		sqface_debug("No free memory.\n");
+		return -1;
+	}
+	w1 = w;
+	h1 = h;
+	bpp1 = 8;
+	bypp1 = 1;
+	stride1 = w1;
+
+	BYTE *src = FreeImage_GetBits(dib);
+	int pitch = FreeImage_GetPitch(dib);
+	for (int y = 0; y < h; y++) {
+		BYTE *s = src + pitch*(h-1-y); // FreeImage хранит снизу вверх
+		BYTE *d = p1 + stride1*y;
+		if (bypp == 1) {
+			memcpy(d, s, w);
+		} else {
+			// как FreeImage_ConvertToGreyscale (Rec. 709)
+			for (int x = 0; x < w; x++, s += bypp) {
+				d[x] = (BYTE)(0.2126F*s[FI_RGBA_RED] + 0.7152F*s[FI_RGBA_GREEN] + 0.0722F*s[FI_RGBA_BLUE] + 0.5F);
+			}
+		}
+	}
 
-	w1 = FreeImage_GetWidth(dib1);
-	h1 = FreeImage_GetHeight(dib1);
-	p1 = FreeImage_GetBits(dib1);
-	bpp1 = FreeImage_GetBPP(dib1);
-	bypp1 = bpp1/8;
-	stride1 = FreeImage_GetPitch(dib1); // что такое Pitch?
+	if (dib_grey) FreeImage_Unload(dib_grey);
 	sqface_debug("bypp1 = %d\n", bypp1);
+	return 0;
+}
+/* }}} */
 
+// Посчитать интегральные матрицы по "серой" картинке p1; y0 > 0 - картинка
+// того же размера изменилась только с этой строки, выше матрицы те же
+int TFaceRecognizer::BuildIntegrals(int y0) /* {{{ */
+{
 	// "Интегральная" матрица
 	w2 = w1;
 	h2 = h1; // no crop
 	bypp2 = sizeof(SUM_TYPE); // of bytes
 	bpp2 = bypp2*8; // bits
 	stride2 = w2*bypp2; // unaligned
-	p2 = (SUM_TYPE *)malloc(h2*stride2); // в байтах, (h2 x w2)
-	if(!p2) {
-		sqface_debug("No free memory.\n");
-		return -1;
+	p2 = NULL;
+	c_local = NULL;
+	if (sum16) {
+		if (BuildSum16() < 0) return -1;
+	} else {
+		p2 = (SUM_TYPE *)ws->Reserve(SQFACE_WS_SUM, (size_t)h2*w2*bypp2); // в байтах, (h2 x w2)
+		if(!p2) {
+			sqface_debug("No free memory.\n");
+			return -1;
+		}
 	}
 
-	// "Интегральная" матрица
-	w3 = w1;
-	h3 = h1; // no crop
+	// "Интегральная" матрица (по блокам, если sq_shift > 0)
+	w3 = w1 >> sq_shift;
+	h3 = h1 >> sq_shift; // неполные блоки справа и снизу не входят
+	if (w3 == 0 || h3 == 0) {
+		// картинка меньше блока
+		sq_shift = 0;
+		w3 = w1;
+		h3 = h1;
+	}
 	bypp3 = sizeof(SUM_TYPE2); // of bytes
 	bpp3 = bypp3*8; // bits
 	stride3 = w3*bypp3; // unaligned
-	p3 = (SUM_TYPE2 *)malloc(h3*stride3); // в байтах, (h3 x w3)
+	p3 = (SUM_TYPE2 *)ws->Reserve(SQFACE_WS_SQSUM, (size_t)h3*w3*bypp3); // в байтах, (h3 x w3)
 	if(!p3) {
 		sqface_debug("No free memory.\n");
 		return -1;
@@ -261,45 +926,71 @@ int TFaceRecognizer::LoadImage(const char *filename_i) /* {{{ */
 	// Посчитать интегральное изображение
 	// (однопоточный вариант алгоритма, по горизонтальным линиям)
 	int x,y;
-	p2[w2*0+0] = p1[stride1*0+bypp1*0];
-	y = 0;
-	for (x = 1; x < w2; x++) {
-		p2[w2*y+x] = p2[w2*y+(x-1)] + p1[stride1*y+bypp1*x];
-	}
-	for (y = 1; y < h2; y++) {
-		p2[w2*y+0] = p2[w2*(y-1)+0] + p1[stride1*y+bypp1*0]; // x == 0
-		for (x = 1; x < w0; x++) {
-			p2[w2*(y-0)+(x-0)] =
-				p1[stride1*y+bypp1*x] +
-				p2[w2*(y-1)+(x-0)] +
-				p2[w2*(y-0)+(x-1)] -
-				p2[w2*(y-1)+(x-1)];
+	if (p2) {
+		if (y0 == 0) {
+			p2[w2*0+0] = p1[stride1*0+bypp1*0];
+			y = 0;
+			for (x = 1; x < w2; x++) {
+				p2[w2*y+x] = p2[w2*y+(x-1)] + p1[stride1*y+bypp1*x];
+			}
+		}
+		for (y = max(1,y0); y < h2; y++) {
+			p2[w2*y+0] = p2[w2*(y-1)+0] + p1[stride1*y+bypp1*0]; // x == 0
+			for (x = 1; x < w2; x++) {
+				p2[w2*(y-0)+(x-0)] =
+					p1[stride1*y+bypp1*x] +
+					p2[w2*(y-1)+(x-0)] +
+					p2[w2*(y-0)+(x-1)] -
+					p2[w2*(y-1)+(x-1)];
+			}
 		}
 	}
 	// "квадраты"
-	p3[w3*0+0] = sqr(p1[stride1*0+bypp1*0]);
-	y = 0;
-	for (x = 1; x < w3; x++) {
-		p3[w3*y+x] = p3[w3*y+(x-1)] + sqr(p1[stride1*y+bypp1*x]);
-	}
-	for (y = 1; y < h2; y++) {
-		p3[w3*y+0] = p3[w3*(y-1)+0] + sqr(p1[stride1*y+bypp1*0]); // x == 0
-		for (x = 1; x < w0; x++) {
-			p3[w3*(y-0)+(x-0)] =
-				sqr(p1[stride1*y+bypp1*x]) +
-				p3[w3*(y-1)+(x-0)] +
-				p3[w3*(y-0)+(x-1)] -
-				p3[w3*(y-1)+(x-1)];
+	if (sq_shift > 0) {
+		// суммы квадратов по блокам, накопленные как обычно
+		int k = 1 << sq_shift;
+		for (y = y0 >> sq_shift; y < h3; y++) {
+			SUM_TYPE2 row = 0;
+			for (x = 0; x < w3; x++) {
+				for (int yy = y*k; yy < y*k+k; yy++) {
+					const BYTE *s = p1 + stride1*yy + bypp1*x*k;
+					for (int xx = 0; xx < k; xx++) row += sqr(s[bypp1*xx]);
+				}
+				p3[w3*y+x] = row + (y > 0 ? p3[w3*(y-1)+x] : 0);
+			}
+		}
+	} else {
+		if (y0 == 0) {
+			p3[w3*0+0] = sqr(p1[stride1*0+bypp1*0]);
+			y = 0;
+			for (x = 1; x < w3; x++) {
+				p3[w3*y+x] = p3[w3*y+(x-1)] + sqr(p1[stride1*y+bypp1*x]);
+			}
+		}
+		for (y = max(1,y0); y < h3; y++) {
+			p3[w3*y+0] = p3[w3*(y-1)+0] + sqr(p1[stride1*y+bypp1*0]); // x == 0
+			for (x = 1; x < w3; x++) {
+				p3[w3*(y-0)+(x-0)] =
+					sqr(p1[stride1*y+bypp1*x]) +
+					p3[w3*(y-1)+(x-0)] +
+					p3[w3*(y-0)+(x-1)] -
+					p3[w3*(y-1)+(x-1)];
+			}
 		}
 	}
+	p4 = NULL; // модуль градиента и повернутая матрица - только если понадобятся
+	p6 = NULL; // (маска кожи - по "цветной" картинке, она здесь та же)
+
 	// p0
-	for (y = 0; y < 4; y++) {
-		for (x = 0; x < 4; x++) {
-			sqface_debug(" %02X", p0[stride0*y+bypp0*x+2]);
+	if (p0) {
+		for (y = 0; y < 4; y++) {
+			for (x = 0; x < 4; x++) {
+				sqface_debug(" %02X", p0[stride0*y+bypp0*x+2]);
+			}
+			sqface_debug("\n");
 		}
 		sqface_debug("\n");
 	}
-	sqface_debug("\n");
 	// p1
 	for (y = 0; y < 4; y++) {
 		for (x = 0; x < 4; x++) {
@@ -318,7 +1009,7 @@ int TFaceRecognizer::LoadImage(const char *filename_i) /* {{{ */
 	sqface_debug("\n");
 
 	// p2
-	for (y = 0; y < 4; y++) {
+	for (y = 0; y < 4 && p2; y++) {
 		for (x = 0; x < 4; x++) {
 			sqface_debug(" %9d", p2[w2*y+x]);
 		}
@@ -327,8 +1018,8 @@ int TFaceRecognizer::LoadImage(const char *filename_i) /* {{{ */
 	sqface_debug("\n");
 
 	// p3
-	for (y = 0; y < 4; y++) {
-		for (x = 0; x < 4; x++) {
+	for (y = 0; y < min(4,(int)h3); y++) {
+		for (x = 0; x < min(4,(int)w3); x++) {
 			sqface_debug(" %9d", p3[w3*y+x]);
 		}
 		sqface_debug("\n");
@@ -339,6 +1030,58 @@ int TFaceRecognizer::LoadImage(const char *filename_i) /* {{{ */
 
 int TFaceRecognizer::LoadCascadeXML(const char *filename_i_txt) /* {{{ */
 {
+	n_cascades = 0;
+	n_margins = 0;
+	return AddCascade(filename_i_txt, -1) < 0 ? -1 : 0;
+}
+/* }}} */
+
+// Добавить каскад к уже загруженным: окно - как у первого (окна
+// сканируются один раз, дисперсия окна - общая)
+int TFaceRecognizer::AddCascadeXML(const char *filename_i_txt) /* {{{ */
+{
+	return AddCascade(filename_i_txt, -1);
+}
+/* }}} */
+
+// Добавить дочерний каскад: ищется после основного прохода, только внутри
+// лиц каскада i_parent (по тем же интегральным матрицам)
+int TFaceRecognizer::AddSubCascadeXML(const char *filename_i_txt, int i_parent, const float *roi, float min_rel, float max_rel) /* {{{ */
+{
+	if (i_parent < 0 || i_parent >= n_cascades || cascades[i_parent].parent >= 0 || cascades[i_parent].rot) {
+		sqface_debug("invalid parent cascade %d\n", i_parent);
+		return -1;
+	}
+	if (min_rel <= 0 || max_rel < min_rel ||
+			(roi && (roi[0] >= roi[2] || roi[1] >= roi[3]))) {
+		sqface_debug("invalid sub-cascade region\n");
+		return -1;
+	}
+	int i = AddCascade(filename_i_txt, i_parent);
+	if (i < 0) return -1;
+	TXMLCascade *c = &cascades[i];
+	c->roi[0] = roi ? roi[0] : 0;
+	c->roi[1] = roi ? roi[1] : 0;
+	c->roi[2] = roi ? roi[2] : 1;
+	c->roi[3] = roi ? roi[3] : 1;
+	c->min_rel = min_rel;
+	c->max_rel = max_rel;
+	return i;
+}
+/* }}} */
+
+// Загрузить каскад следом за прежними: его этапы, узлы и прямоугольники -
+// в общих массивах после уже загруженных
+int TFaceRecognizer::AddCascade(const char *filename_i_txt, int i_parent) /* {{{ */
+{
+	// повернутые копии - всегда в хвосте, за загруженными: выкинуть,
+	// Recognize() сделает заново (номера загруженных - подряд)
+	while (n_cascades > 0 && cascades[n_cascades-1].rot) n_cascades--;
+	if (n_cascades >= MAX_CASCADES) {
+		sqface_debug("too many cascades\n");
+		return -1;
+	}
+
 	// Read file
 	ifstream f(filename_i_txt);
 	string xml;
@@ -349,7 +1092,10 @@ int TFaceRecognizer::LoadCascadeXML(const char *filename_i_txt) /* {{{ */
 		return -1;
 	}
 
-	while (getline(f,line)) xml += line;
+	while (getline(f,line)) {
+		xml += line;
+		xml += '\n'; // числа в LBP-каскадах переносятся на другую строку
+	}
 
 	std::vector<char> xml_copy(xml.begin(), xml.end());
 	xml_copy.push_back('\0');
@@ -364,23 +1110,77 @@ int TFaceRecognizer::LoadCascadeXML(const char *filename_i_txt) /* {{{ */
 	xml_node<> *node2 = node1->first_node();//"haarcascade_frontalface_alt");
 	if(!node2) return -1;
 
+	TXMLCascade *c = &this->cascades[n_cascades];
+	memset(c, 0, sizeof(*c));
+	if (n_cascades > 0) {
+		const TXMLCascade *prev = &this->cascades[n_cascades-1];
+		c->i_stage_1 = prev->i_stage_1 + prev->n_stages;
+		c->i_feature_1 = prev->i_feature_1 + prev->n_features;
+		c->i_rect_1 = prev->i_rect_1 + prev->n_rects;
+	}
+
+	int ret;
+	if (node2->first_node("featureType")) {
+		// новый формат OpenCV (traincascade)
+		xml_node<> *node = node2->first_node("featureType");
+		if (strcmp(node->value(), "LBP")) {
+			sqface_debug("unsupported cascade feature type '%s'\n", node->value());
+			return -1;
+		}
+		ret = LoadCascadeLBP(c, node2);
+	} else {
+		ret = LoadCascadeHaar(c, node2);
+	}
+	if (ret < 0) return -1;
+	c->parent = i_parent;
+	c->source = n_cascades;
+	c->rot = 0;
+
+	if (i_parent < 0 && n_cascades > 0 && (c->window_w_mini != this->cascades[0].window_w_mini ||
+			c->window_h_mini != this->cascades[0].window_h_mini)) {
+		sqface_debug("cascade window %dx%d differs from %dx%d\n",
+				c->window_w_mini, c->window_h_mini,
+				this->cascades[0].window_w_mini, this->cascades[0].window_h_mini);
+		return -1;
+	}
+	c->threshold_sum = 0;
+	for (int i_stage = 0; i_stage < c->n_stages; i_stage++) {
+		c->threshold_sum += this->stages[c->i_stage_1+i_stage].stage_threshold;
+	}
+	n_margins = max(n_margins, c->n_stages);
+	n_cached = -1; // окна прошлого Recognize() - без этого каскада
+	return n_cascades++;
+}
+/* }}} */
+
+// Каскад Хаара (старый формат OpenCV, haarcascade_*.xml)
+int TFaceRecognizer::LoadCascadeHaar(TXMLCascade *c, xml_node<> *node2) /* {{{ */
+{
+	c->type = SQFACE_CASCADE_HAAR;
+	c->has_tilted = 0;
+
 	xml_node<> *node3 = node2->first_node("size");
 	if(!node3) return -1;
 	char *p1;
-	p1 = strtok(node3->value(), " "); this->cascade.window_w_mini = atoi(p1);
-	p1 = strtok(0x00, " "); this->cascade.window_h_mini = atoi(p1);
-	this->cascade.n_stages = 0;
-	this->cascade.n_rects = 0;
+	p1 = strtok(node3->value(), " "); c->window_w_mini = atoi(p1);
+	p1 = strtok(0x00, " "); c->window_h_mini = atoi(p1);
+	c->n_stages = 0;
+	c->n_rects = 0;
 
-	int i_stage = 0;
-	int i_feature_abs = 0;
-	int i_rect_abs = 0;
+	int i_stage = c->i_stage_1;
+	int i_feature_abs = c->i_feature_1;
+	int i_rect_abs = c->i_rect_1;
+	int i_tree = i_feature_abs; // корень текущего дерева
 
 	xml_node<> *node4 = node2->first_node("stages");
 	if(!node4) return -1;
 	xml_node<> *node5 = node4->first_node("_");
 	if(!node5) return -1;
 	do {
+		if (i_stage >= MAX_STAGES) {
+			sqface_debug("too many stages in cascade\n");
+			return -1;
+		}
 
 		xml_node<> *node6 = node5->first_node("trees");
 		if(!node6) {return -1;}
@@ -409,23 +1209,36 @@ int TFaceRecognizer::LoadCascadeXML(const char *filename_i_txt) /* {{{ */
 
 		xml_node<> *node8 = node7->first_node("_"); // tree ...
 		if(!node8) {return -1;}
+		i_tree = i_feature_abs;
 		do {
+			if (i_feature_abs >= MAX_FEATURES) {
+				sqface_debug("too many features in cascade\n");
+				return -1;
+			}
 
 			xml_node<> *node15 = node8->first_node("feature");
 			if(!node15) {return -1;}
 			xml_node<> *node16 = node15->first_node("rects");
 			if(!node16) {return -1;}
 			xml_node<> *node17 = node16->first_node("_");
+			xml_node<> *node18 = node15->first_node("tilted");
+			int tilted = node18 && atoi(node18->value()) != 0;
 
 			xml_node<> *node12 = node8->first_node("threshold");
 			if(!node12) {return -1;}
 			float feature_threshold = atof(node12->value());
 
-			float left_val = -1.0;
-			float right_val = -1.0;
+			// лист (*_val) или номер дочернего узла в дереве (*_node)
+			float left_val = 0.0;
+			float right_val = 0.0;
+			int left = 0;
+			int right = 0;
 			xml_node<> *node13 = node8->first_node("left_val");
 			if(!node13) {
 				node13 = node8->first_node("left_node");
+				if(!node13) {return -1;}
+				left = atoi(node13->value()) - (i_feature_abs - i_tree);
+				if(left <= 0) {return -1;} // только вперед - без циклов
 			}
 			else {
 				left_val = atof(node13->value());
@@ -434,6 +1247,9 @@ int TFaceRecognizer::LoadCascadeXML(const char *filename_i_txt) /* {{{ */
 			xml_node<> *node14 = node8->first_node("right_val");
 			if(!node14) {
 				node14 = node8->first_node("right_node");
+				if(!node14) {return -1;}
+				right = atoi(node14->value()) - (i_feature_abs - i_tree);
+				if(right <= 0) {return -1;}
 			}
 			else {
 				right_val = atof(node14->value());
@@ -444,6 +1260,17 @@ int TFaceRecognizer::LoadCascadeXML(const char *filename_i_txt) /* {{{ */
 			this->features[i_feature_abs].feature_threshold = feature_threshold;
 			this->features[i_feature_abs].left_val = left_val;
 			this->features[i_feature_abs].right_val = right_val;
+			this->features[i_feature_abs].left = left;
+			this->features[i_feature_abs].right = right;
+			this->features[i_feature_abs].n_nodes = 1;
+			this->features[i_feature_abs].n_rects = 0;
+			this->features[i_feature_abs].tilted = tilted;
+			// площадь повернутого прямоугольника 2*w*h: OpenCV делит веса на 2,
+			// здесь вместо этого удваиваем порог
+			if (tilted) {
+				this->features[i_feature_abs].feature_threshold *= 2;
+				c->has_tilted = 1;
+			}
 			if (this->stages[i_stage].i_feature_abs_1 > i_feature_abs)
 				this->stages[i_stage].i_feature_abs_1 = i_feature_abs;
 			if (this->stages[i_stage].i_feature_abs_2 < i_feature_abs)
@@ -456,6 +1283,10 @@ int TFaceRecognizer::LoadCascadeXML(const char *filename_i_txt) /* {{{ */
 			if(!node17) {return -1;}
 			do {
 				int x,y,w,h;
+				if (i_rect_abs >= MAX_RECTS) {
+					sqface_debug("too many rects in cascade\n");
+					return -1;
+				}
 				int weight;
 
 				char *p2;
@@ -464,6 +1295,12 @@ int TFaceRecognizer::LoadCascadeXML(const char *filename_i_txt) /* {{{ */
 				p2 = strtok(0x00, " "); w = atoi(p2);
 				p2 = strtok(0x00, " "); h = atoi(p2);
 				p2 = strtok(0x00, " "); weight = (int)nearbyint(atof(p2));
+				// повернутый прямоугольник: от (x,y) вправо-вниз на w, влево-вниз на h
+				if (tilted && (x-h < 0 || x+w > c->window_w_mini ||
+						y+w+h > c->window_h_mini)) {
+					sqface_debug("tilted rect out of window: %d %d %d %d\n", x, y, w, h);
+					return -1;
+				}
 
 				this->rects[i_rect_abs].x = x;
 				this->rects[i_rect_abs].y = y;
@@ -477,7 +1314,7 @@ int TFaceRecognizer::LoadCascadeXML(const char *filename_i_txt) /* {{{ */
 				this->features[i_feature_abs].n_rects = this->features[i_feature_abs].n_rects + 1;
 				this->stages[i_stage].n_rects = this->stages[i_stage].n_rects + 1;
 
-				this->cascade.n_rects = this->cascade.n_rects + 1;
+				c->n_rects = c->n_rects + 1;
 				i_rect_abs = i_rect_abs + 1;
 
 				node17 = node17->next_sibling("_");
@@ -486,32 +1323,251 @@ int TFaceRecognizer::LoadCascadeXML(const char *filename_i_txt) /* {{{ */
 
 			i_feature_abs = i_feature_abs + 1;
 
+			node8 = node8->next_sibling("_"); // следующий узел того же дерева
+			if(node8) {continue;}
+			// дерево целиком: дочерние узлы не должны выходить за него
+			int n_nodes = i_feature_abs - i_tree;
+			for (int k = 0; k < n_nodes; k++) {
+				if (this->features[i_tree+k].left >= n_nodes-k) {return -1;}
+				if (this->features[i_tree+k].right >= n_nodes-k) {return -1;}
+			}
+			this->features[i_tree].n_nodes = n_nodes;
+
 			node7 = node7->next_sibling("_");
 			if(!node7) {break;}
 			node8 = node7->first_node("_");
 			if(!node8) {break;}
+			i_tree = i_feature_abs;
 		} while (1);
 
-		this->cascade.n_stages = this->cascade.n_stages + 1;
+		c->n_stages = c->n_stages + 1;
 		i_stage = i_stage + 1;
 
 		node5 = node5->next_sibling("_");
 		if(!node5) {break;}
 
 	} while(1);
+	c->n_features = i_feature_abs - c->i_feature_1;
 	return 0;
 }
 /* }}} */
 
-// Записать изображение
-int TFaceRecognizer::SaveImage(const char *filename_o) /* {{{ */
+// LBP-каскад OpenCV (lbpcascade_frontalface.xml): <features> - блоки
+// признаков, в узле <internalNodes> "0 -1 номер_признака subset[8]",
+// <leafValues> - значения для бита subset есть / нет
+int TFaceRecognizer::LoadCascadeLBP(TXMLCascade *c, xml_node<> *node2) /* {{{ */
 {
-	FREE_IMAGE_FORMAT fif;
-	//  FreeImage_FlipVertical(dib1);
-	sqface_debug("Save: %s\n", filename_o);
-	sqface_debug("w = %d\n", FreeImage_GetWidth(dib0));
+	xml_node<> *node;
+	int n_rects = 0, n_nodes = 0, n_stages = 0;
+
+	c->n_stages = 0; // пока не загружен целиком - нет каскада
+	node = node2->first_node("width");
+	if (!node) return -1;
+	c->window_w_mini = atoi(node->value());
+	node = node2->first_node("height");
+	if (!node) return -1;
+	c->window_h_mini = atoi(node->value());
+
+	xml_node<> *node_features = node2->first_node("features");
+	if (!node_features) return -1;
+	for (node = node_features->first_node("_"); node; node = node->next_sibling("_")) {
+		xml_node<> *node_rect = node->first_node("rect");
+		int x, y, w, h;
+		if (!node_rect || c->i_rect_1+n_rects >= MAX_RECTS) return -1;
+		if (sscanf(node_rect->value(), "%d %d %d %d", &x, &y, &w, &h) != 4) return -1;
+		if (x < 0 || y < 0 || w <= 0 || h <= 0 ||
+				x+3*w > c->window_w_mini || y+3*h > c->window_h_mini ||
+				max(x+3*w, y+3*h) >= MAX_W) {
+			sqface_debug("invalid LBP feature %d: %d %d %d %d\n", n_rects, x, y, w, h);
+			return -1;
+		}
+		TRect *r = &this->rects[c->i_rect_1 + n_rects++];
+		r->i_stage = -1;
+		r->i_feature = -1;
+		r->i_rect = 0;
+		r->x = x;
+		r->y = y;
+		r->w = w;
+		r->h = h;
+		r->weight = 1;
+	}
 
-	fif = FreeImage_GetFIFFromFilename(filename_o);
+	xml_node<> *node_stages = node2->first_node("stages");
+	if (!node_stages) return -1;
+	for (xml_node<> *node_stage = node_stages->first_node("_"); node_stage; node_stage = node_stage->next_sibling("_")) {
+		if (c->i_stage_1+n_stages >= MAX_STAGES) return -1;
+		node = node_stage->first_node("stageThreshold");
+		xml_node<> *node_weak = node_stage->first_node("weakClassifiers");
+		if (!node || !node_weak) return -1;
+
+		TStage *stage = &this->stages[c->i_stage_1+n_stages];
+		stage->stage_threshold = atof(node->value());
+		stage->n_features = 0;
+		stage->n_rects = 0;
+		stage->i_feature_abs_1 = c->i_feature_1+n_nodes;
+		stage->i_feature_abs_2 = c->i_feature_1+n_nodes-1;
+
+		for (node = node_weak->first_node("_"); node; node = node->next_sibling("_")) {
+			xml_node<> *node_internal = node->first_node("internalNodes");
+			xml_node<> *node_leaf = node->first_node("leafValues");
+			if (!node_internal || !node_leaf || c->i_feature_1+n_nodes >= MAX_FEATURES) return -1;
+
+			// "0 -1 i_feature subset[8]" - дерево из одного узла
+			TLBPNode *n = &this->lbp_nodes[c->i_feature_1+n_nodes];
+			char *s = node_internal->value(), *e;
+			long v[11];
+			for (int k = 0; k < 11; k++) {
+				v[k] = strtol(s, &e, 10);
+				if (e == s) return -1;
+				s = e;
+			}
+			if (v[2] < 0 || v[2] >= n_rects) return -1;
+			n->i_rect = c->i_rect_1+(int)v[2];
+			for (int k = 0; k < 8; k++) n->subset[k] = (int)v[3+k];
+			if (sscanf(node_leaf->value(), "%f %f", &n->left_val, &n->right_val) != 2) return -1;
+
+			n_nodes++;
+			stage->i_feature_abs_2 = c->i_feature_1+n_nodes-1;
+			stage->n_features++;
+			stage->n_rects += 9;
+		}
+		n_stages++;
+	}
+
+	c->type = SQFACE_CASCADE_LBP;
+	c->has_tilted = 0;
+	c->n_rects = n_rects;
+	c->n_features = n_nodes;
+	c->n_stages = n_stages;
+	sqface_debug("LBP cascade: %d stages, %d nodes, %d features\n", n_stages, n_nodes, n_rects);
+	return 0;
+}
+/* }}} */
+
+// Прямоугольник окна ww x wh после поворота окна на 90 градусов по часовой:
+// точка (u,v) -> (wh-v,u); kind: 0 - обычный, 1 - повернутый на 45 градусов
+// (вершина (x,y), w вправо-вниз, h влево-вниз), 2 - сетка LBP 3x3 блока
+static void rotate_rect_90(TRect *r, int wh, int kind) /* {{{ */
+{
+	int x = r->x, y = r->y, w = r->w, h = r->h;
+	switch (kind) {
+		case 1:
+			r->x = wh-y-h;
+			r->y = x-h;
+			break;
+		case 2:
+			r->x = wh-y-3*h;
+			r->y = x;
+			break;
+		default:
+			r->x = wh-y-h;
+			r->y = x;
+			break;
+	}
+	r->w = h;
+	r->h = w;
+}
+/* }}} */
+
+// Код LBP после поворота на 90 градусов: сосед q (по часовой от левого
+// верхнего, бит 7-q) переходит в соседа q+2 - переставить биты subset
+static void rotate_lbp_subset_90(int *subset) /* {{{ */
+{
+	int s[8];
+	memset(s, 0, sizeof(s));
+	for (int code = 0; code < 256; code++) {
+		int old = 0;
+		for (int q = 0; q < 8; q++) {
+			if (code & (1 << (7-((q+2) & 7)))) old |= 1 << (7-q);
+		}
+		if (subset[old >> 5] & (1 << (old & 31))) s[code >> 5] |= 1 << (code & 31);
+	}
+	memcpy(subset, s, sizeof(s));
+}
+/* }}} */
+
+// Копия каскада i_src, повернутая на rot*90 градусов по часовой, - в общих
+// массивах следом за прежними: прямоугольники пересчитаны в повернутое окно
+// (у LBP еще переставлены биты кода), так что повернутые лица ищутся по тем
+// же интегральным матрицам и в том же проходе. Только квадратные окна -
+// иначе копии нужен свой проход; вернуть номер копии
+int TFaceRecognizer::RotateCascade(int i_src, int rot) /* {{{ */
+{
+	const TXMLCascade *s = &cascades[i_src];
+	if (s->window_w_mini != s->window_h_mini) {
+		sqface_debug("cascade %d: window %dx%d is not square, not rotated\n", i_src, s->window_w_mini, s->window_h_mini);
+		return -1;
+	}
+	if (n_cascades >= MAX_CASCADES) {
+		sqface_debug("too many cascades\n");
+		return -1;
+	}
+	const TXMLCascade *prev = &cascades[n_cascades-1];
+	TXMLCascade *c = &cascades[n_cascades];
+	*c = *s;
+	c->i_stage_1 = prev->i_stage_1 + prev->n_stages;
+	c->i_feature_1 = prev->i_feature_1 + prev->n_features;
+	c->i_rect_1 = prev->i_rect_1 + prev->n_rects;
+	if (c->i_stage_1+c->n_stages > MAX_STAGES || c->i_feature_1+c->n_features > MAX_FEATURES ||
+			c->i_rect_1+c->n_rects > MAX_RECTS) {
+		sqface_debug("no room for rotated cascade\n");
+		return -1;
+	}
+	c->source = i_src;
+	c->rot = rot;
+	int d_stage = c->i_stage_1 - s->i_stage_1;
+	int d_feature = c->i_feature_1 - s->i_feature_1;
+	int d_rect = c->i_rect_1 - s->i_rect_1;
+
+	for (int i = 0; i < c->n_stages; i++) {
+		TStage *st = &this->stages[c->i_stage_1+i];
+		*st = this->stages[s->i_stage_1+i];
+		st->i_feature_abs_1 += d_feature;
+		st->i_feature_abs_2 += d_feature;
+	}
+	for (int i = 0; i < c->n_rects; i++) {
+		this->rects[c->i_rect_1+i] = this->rects[s->i_rect_1+i];
+	}
+	for (int i = 0; i < c->n_features; i++) {
+		if (c->type == SQFACE_CASCADE_LBP) {
+			TLBPNode *n = &this->lbp_nodes[c->i_feature_1+i];
+			*n = this->lbp_nodes[s->i_feature_1+i];
+			n->i_rect += d_rect;
+			for (int k = 0; k < rot; k++) rotate_lbp_subset_90(n->subset);
+			continue;
+		}
+		TFeature *f = &this->features[c->i_feature_1+i];
+		*f = this->features[s->i_feature_1+i];
+		f->i_stage += d_stage;
+		f->i_rect_abs_1 += d_rect;
+		f->i_rect_abs_2 += d_rect;
+		for (int r = f->i_rect_abs_1; r <= f->i_rect_abs_2; r++) {
+			for (int k = 0; k < rot; k++) rotate_rect_90(&this->rects[r], c->window_h_mini, f->tilted);
+		}
+	}
+	if (c->type == SQFACE_CASCADE_LBP) {
+		for (int i = 0; i < c->n_rects; i++) {
+			for (int k = 0; k < rot; k++) rotate_rect_90(&this->rects[c->i_rect_1+i], c->window_h_mini, 2);
+		}
+	}
+	n_cached = -1;
+	return n_cascades++;
+}
+/* }}} */
+
+// Записать изображение
+int TFaceRecognizer::SaveImage(const char *filename_o) /* {{{ */
+{
+	FREE_IMAGE_FORMAT fif;
+	sqface_debug("Save: %s\n", filename_o);
+
+	if (!dib0) {
+		sqface_debug("no color image loaded, nothing to save\n");
+		return -1;
+	}
+	sqface_debug("w = %d\n", FreeImage_GetWidth(dib0));
+
+	fif = FreeImage_GetFIFFromFilename(filename_o);
 	if (fif == FIF_UNKNOWN) {
 		sqface_debug("failed to detect file format from filename '%s'\n", filename_o);
 		return -1;
@@ -530,173 +1586,1939 @@ int TFaceRecognizer::SaveImage(const char *filename_o) /* {{{ */
 }
 /* }}} */
 
-// Выгрузить изображение
-int TFaceRecognizer::UnloadImage() /* {{{ */
+// Сжатая интегральная матрица: внутри блока 16x16 - 16-битные суммы
+// от угла блока, на краях блоков - 32-битные суммы (2.5 байта на пиксель
+// вместо 4)
+int TFaceRecognizer::BuildSum16() /* {{{ */
 {
-	if (p2) {
-		free(p2);
-		p2 = NULL;
+	n_bx = (w2 + (1 << SQFACE_BLOCK_SHIFT) - 1) >> SQFACE_BLOCK_SHIFT;
+	n_by = (h2 + (1 << SQFACE_BLOCK_SHIFT) - 1) >> SQFACE_BLOCK_SHIFT;
+	size_t size_local = ((size_t)h2*w2*sizeof(WORD) + SQFACE_WS_ALIGN-1) & ~((size_t)SQFACE_WS_ALIGN-1);
+	size_t size_left = (size_t)h2*n_bx*sizeof(SUM_TYPE);
+	size_t size_top = (size_t)n_by*w2*sizeof(SUM_TYPE);
+	size_t size_rows = 2*(size_t)w2*sizeof(SUM_TYPE); // две строки полной матрицы
+	BYTE *p = (BYTE *)ws->Reserve(SQFACE_WS_SUM, size_local+size_left+size_top+size_rows);
+	if (!p) {
+		sqface_debug("No free memory.\n");
+		return -1;
+	}
+	c_local = (WORD *)p;
+	c_left = (SUM_TYPE *)(p+size_local);
+	c_top = (SUM_TYPE *)(p+size_local+size_left);
+	SUM_TYPE *prev = (SUM_TYPE *)(p+size_local+size_left+size_top);
+	SUM_TYPE *cur = prev+w2;
+
+	// полная матрица считается построчно, хранятся только отличия от краев блока
+	memset(prev, 0, w2*sizeof(SUM_TYPE));
+	for (int y = 0; y < h2; y++) {
+		int by = y >> SQFACE_BLOCK_SHIFT;
+		SUM_TYPE *top = c_top + w2*by;
+		if ((y & ((1 << SQFACE_BLOCK_SHIFT)-1)) == 0) {
+			memcpy(top, prev, w2*sizeof(SUM_TYPE)); // I(x,Y0-1)
+		}
+		const BYTE *s = p1 + stride1*y;
+		SUM_TYPE row = 0;
+		SUM_TYPE left = 0;
+		SUM_TYPE *l = c_left + n_bx*y;
+		WORD *d = c_local + w2*y;
+		for (int x = 0; x < w2; x++) {
+			row += s[bypp1*x];
+			cur[x] = prev[x] + row;
+			if ((x & ((1 << SQFACE_BLOCK_SHIFT)-1)) == 0) {
+				// I(X0-1,y) - I(X0-1,Y0-1)
+				left = x > 0 ? cur[x-1] - top[x-1] : 0;
+				l[x >> SQFACE_BLOCK_SHIFT] = left;
+			}
+			d[x] = (WORD)(cur[x] - left - top[x]);
+		}
+		SUM_TYPE *t = prev; prev = cur; cur = t;
+	}
+	return 0;
+}
+/* }}} */
+
+// Интегральная матрица модуля градиента |dx|+|dy| (центральные разности)
+// для SQFACE_EDGE_PRUNING - одна на картинку, при первом Recognize()
+int TFaceRecognizer::BuildEdgeIntegral() /* {{{ */
+{
+	w4 = w1;
+	h4 = h1;
+	p4 = (unsigned int *)ws->Reserve(SQFACE_WS_EDGES, (size_t)h4*w4*sizeof(unsigned int));
+	if (!p4) {
+		sqface_debug("No free memory.\n");
+		return -1;
+	}
+
+	for (int y = 0; y < h4; y++) {
+		const BYTE *r = p1 + stride1*y;
+		const BYTE *ru = p1 + stride1*max(0,y-1);
+		const BYTE *rd = p1 + stride1*min(h4-1,y+1);
+		unsigned int *e = p4 + w4*y;
+		unsigned int row = 0;
+		for (int x = 0; x < w4; x++) {
+			int xl = max(0,x-1), xr = min(w4-1,x+1);
+			row += abs(r[bypp1*xr]-r[bypp1*xl]) + abs(rd[bypp1*x]-ru[bypp1*x]);
+			e[x] = row + (y > 0 ? e[x-w4] : 0);
+		}
+	}
+	return 0;
+}
+/* }}} */
+
+#if defined(__SSE2__)
+// 4 точки (3 или 4 байта) - в 32-битные слова; 3 байта - сдвигами
+// одного чтения 16 байт (за 4-й точкой читается еще 4 байта)
+static inline __m128i skin_load4(const BYTE *s, int bypp) /* {{{ */
+{
+	__m128i v = _mm_loadu_si128((const __m128i *)s);
+	if (bypp == 4) return v;
+	__m128i a = _mm_unpacklo_epi32(v, _mm_srli_si128(v, 3));
+	__m128i b = _mm_unpacklo_epi32(_mm_srli_si128(v, 6), _mm_srli_si128(v, 9));
+	return _mm_unpacklo_epi64(a, b);
+}
+/* }}} */
+
+// Канал k у 8 точек - в 16-битные слова
+static inline __m128i skin_channel(__m128i a, __m128i b, int k) /* {{{ */
+{
+	const __m128i lo = _mm_set1_epi32(0xFF);
+	a = _mm_and_si128(_mm_srl_epi32(a, _mm_cvtsi32_si128(8*k)), lo);
+	b = _mm_and_si128(_mm_srl_epi32(b, _mm_cvtsi32_si128(8*k)), lo);
+	return _mm_packs_epi32(a, b);
+}
+/* }}} */
+#endif
+
+#ifdef SQFACE_NEON
+static inline uint8x8_t skin_neon8(uint8x8_t r8, uint8x8_t g8, uint8x8_t b8) /* {{{ */
+{
+	uint16x8_t r = vmovl_u8(r8), g = vmovl_u8(g8), b = vmovl_u8(b8);
+	uint16x8_t bias = vdupq_n_u16(32768);
+	uint16x8_t cb = vmlsq_n_u16(vmlsq_n_u16(vshlq_n_u16(b, 7), r, 43), g, 85);
+	uint16x8_t cr = vmlsq_n_u16(vmlsq_n_u16(vshlq_n_u16(r, 7), g, 107), b, 21);
+	cb = vshrq_n_u16(vaddq_u16(cb, bias), 8);
+	cr = vshrq_n_u16(vaddq_u16(cr, bias), 8);
+	uint16x8_t m = vandq_u16(vandq_u16(vcgeq_u16(cb, vdupq_n_u16(77)), vcleq_u16(cb, vdupq_n_u16(127))),
+			vandq_u16(vcgeq_u16(cr, vdupq_n_u16(133)), vcleq_u16(cr, vdupq_n_u16(173))));
+	return vmovn_u16(vshrq_n_u16(m, 15));
+}
+/* }}} */
+#endif
+
+// Строка маски кожи: 1 - Cb, Cr (BT.601) в 77..127, 133..173. Векторно
+// (SSE2, NEON) по 8/16 точек, остаток строки - по одной. Считается в 16
+// битах по модулю 2^16: точные значения до сдвига - в 128..65408
+static void skin_row(const BYTE *s, int bypp, int w, BYTE *mask) /* {{{ */
+{
+	int x = 0;
+#if defined(__SSE2__)
+	const __m128i k43 = _mm_set1_epi16(-43), k85 = _mm_set1_epi16(-85);
+	const __m128i k107 = _mm_set1_epi16(-107), k21 = _mm_set1_epi16(-21);
+	const __m128i bias = _mm_set1_epi16((short)0x8000), one = _mm_set1_epi16(1);
+	int x_end = bypp == 4 ? w-8 : w-10; // 3 байта: 16 байт с (x+4)-й точки - в строке
+	for (; x <= x_end; x += 8) {
+		__m128i a = skin_load4(s+x*bypp, bypp), b = skin_load4(s+(x+4)*bypp, bypp);
+		__m128i r = skin_channel(a, b, FI_RGBA_RED);
+		__m128i g = skin_channel(a, b, FI_RGBA_GREEN);
+		__m128i bl = skin_channel(a, b, FI_RGBA_BLUE);
+		__m128i cb = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(r, k43), _mm_mullo_epi16(g, k85)),
+				_mm_add_epi16(_mm_slli_epi16(bl, 7), bias));
+		__m128i cr = _mm_add_epi16(_mm_add_epi16(_mm_slli_epi16(r, 7), _mm_mullo_epi16(g, k107)),
+				_mm_add_epi16(_mm_mullo_epi16(bl, k21), bias));
+		cb = _mm_srli_epi16(cb, 8);
+		cr = _mm_srli_epi16(cr, 8);
+		__m128i m = _mm_and_si128(
+				_mm_and_si128(_mm_cmpgt_epi16(cb, _mm_set1_epi16(76)), _mm_cmplt_epi16(cb, _mm_set1_epi16(128))),
+				_mm_and_si128(_mm_cmpgt_epi16(cr, _mm_set1_epi16(132)), _mm_cmplt_epi16(cr, _mm_set1_epi16(174))));
+		m = _mm_and_si128(m, one);
+		_mm_storel_epi64((__m128i *)(mask+x), _mm_packus_epi16(m, m));
+	}
+#elif defined(SQFACE_NEON)
+	for (; x+16 <= w; x += 16) {
+		uint8x16_t r, g, b;
+		if (bypp == 4) {
+			uint8x16x4_t p = vld4q_u8(s+x*4);
+			r = p.val[FI_RGBA_RED]; g = p.val[FI_RGBA_GREEN]; b = p.val[FI_RGBA_BLUE];
+		} else {
+			uint8x16x3_t p = vld3q_u8(s+x*3);
+			r = p.val[FI_RGBA_RED]; g = p.val[FI_RGBA_GREEN]; b = p.val[FI_RGBA_BLUE];
+		}
+		vst1q_u8(mask+x, vcombine_u8(skin_neon8(vget_low_u8(r), vget_low_u8(g), vget_low_u8(b)),
+				skin_neon8(vget_high_u8(r), vget_high_u8(g), vget_high_u8(b))));
+	}
+#endif
+	for (s += x*bypp; x < w; x++, s += bypp) {
+		int r = s[FI_RGBA_RED], g = s[FI_RGBA_GREEN], b = s[FI_RGBA_BLUE];
+		int cb = (-43*r - 85*g + 128*b + 32768) >> 8;
+		int cr = (128*r - 107*g - 21*b + 32768) >> 8;
+		mask[x] = (cb >= 77) & (cb <= 127) & (cr >= 133) & (cr <= 173);
+	}
+}
+/* }}} */
+
+// Интегральная матрица маски цвета кожи по "цветной" картинке
+// для SQFACE_SKIN_PREFILTER: пиксель - кожа, если Cb и Cr (YCbCr, BT.601)
+// в диапазоне Chai & Ngan: 77 <= Cb <= 127, 133 <= Cr <= 173
+int TFaceRecognizer::BuildSkinIntegral() /* {{{ */
+{
+	if (!p0 || (bypp0 != 3 && bypp0 != 4) || w0 != w1 || h0 != h1) {
+		sqface_debug("no color image, skin prefilter disabled\n");
+		return -1;
+	}
+
+	w5 = w1;
+	h5 = h1;
+	// маска строки - после таблицы
+	size_t size = (size_t)h5*w5*sizeof(unsigned int);
+	p5 = (unsigned int *)ws->Reserve(SQFACE_WS_SKIN, size+w5);
+	if (!p5) {
+		sqface_debug("No free memory.\n");
+		return -1;
+	}
+	BYTE *mask = (BYTE *)p5 + size;
+
+	for (int y = 0; y < h5; y++) {
+		skin_row(p0 + stride0*(h0-1-y), bypp0, w5, mask); // FreeImage хранит снизу вверх
+		unsigned int *k = p5 + w5*y;
+		unsigned int row = 0;
+		for (int x = 0; x < w5; x++) {
+			row += mask[x];
+			k[x] = row + (y > 0 ? k[x-w5] : 0);
+		}
+	}
+	return 0;
+}
+/* }}} */
+
+// Повернутая на 45 градусов интегральная матрица (как tilted у cvIntegral):
+// T(X,Y) - сумма пикселей (x,y), y < Y, |x-X+1| <= Y-1-y (треугольник
+// с вершиной в (X-1,Y-1), расширяющийся вверх). По строкам S(x,y) (сумма
+// строки y до x включительно) T(X,Y) = A(X+Y-2) - B(X-Y-1), где
+// A(u) = сумма S(u-y,y), B(v) = сумма S(v+y,y) по y < Y - накопления по
+// диагоналям, за проход O(w*h) без расширения картинки
+int TFaceRecognizer::BuildTiltedIntegral() /* {{{ */
+{
+	w6 = w1+1;
+	h6 = h1+1;
+	int n = w1+h1+2; // диагоналей каждого направления
+	// A, B и суммы строки - после таблицы
+	size_t size = (size_t)h6*w6;
+	p6 = (unsigned int *)ws->Reserve(SQFACE_WS_TILTED, (size+2*n+w1)*sizeof(unsigned int));
+	if (!p6) {
+		sqface_debug("No free memory.\n");
+		return -1;
 	}
-	
-	if (p3) {
-		free(p3);
-		p3 = NULL;
+	unsigned int *a = p6 + size; // a[u+1], u = X+Y-2 >= -1
+	unsigned int *b = a + n;     // b[v+h1+1], v = X-Y-1 >= -h1-1
+	unsigned int *s = b + n;
+	memset(p6, 0, w6*sizeof(unsigned int)); // T(X,0) = 0
+	memset(a, 0, 2*n*sizeof(unsigned int));
+
+	for (int y = 0; y < h1; y++) {
+		const BYTE *r = p1 + stride1*y;
+		unsigned int row = 0;
+		for (int x = 0; x < w1; x++) {
+			row += r[bypp1*x];
+			s[x] = row;
+		}
+		// S(x,y) = 0 при x < 0, = row при x >= w1
+		unsigned int *au = a + 1 + y;
+		for (int x = 0; x < w1; x++) au[x] += s[x];
+		for (int u = y+w1; u <= w1+h1-2; u++) a[u+1] += row;
+		// B(v) дальше читается только при v <= w1-y-2, там v+y < w1
+		unsigned int *bv = b + h1+1 - y;
+		for (int x = 0; x <= w1-2; x++) bv[x] += s[x];
+
+		unsigned int *t = p6 + w6*(y+1);
+		const unsigned int *at = a + y;      // A(X+y-1)
+		const unsigned int *bt = b + h1-1-y; // B(X-y-2)
+		for (int x = 0; x < w6; x++) t[x] = at[x] - bt[x];
 	}
+	return 0;
+}
+/* }}} */
+
+// Выгрузить изображение
+// (буферы остаются в рабочей области до следующей картинки)
+int TFaceRecognizer::UnloadImage() /* {{{ */
+{
+	p1 = NULL;
+	p2 = NULL;
+	c_local = NULL;
+	p3 = NULL;
+	p4 = NULL;
+	p5 = NULL;
+	p6 = NULL;
+	n_changed = -1; // прошлые окна - от другой картинки
+	n_cached = -1;
 
 	if (dib0) {
 		FreeImage_Unload(dib0);
 		dib0 = NULL;
+		p0 = NULL;
 	}
+	return 0;
+}
+/* }}} */
+
+// Точка рамки: синяя (BGR), на 8-битной картинке - белая
+static inline void frame_pixel(BYTE *q, int bypp) /* {{{ */
+{
+	q[0] = 0xFF;
+	if (bypp < 3) return;
+	q[1] = 0x3F;
+	q[2] = 0x3F;
+}
+/* }}} */
+
+// Нарисовать рамку на "цветной" картинке (если она загружена)
+void TFaceRecognizer::DrawRect(int x1, int y1, int x2, int y2) /* {{{ */
+{
+	if (!p0) return;
+
+	// рамка может выходить за картинку (лица у края, наклоны) - только видимое
+	int xa = max(x1, 0), xb = min(x2, (int)w0-1);
+	int ya = max(y1, 0), yb = min(y2, (int)h0-1);
+	if (xa > xb || ya > yb) return;
 
-	if (dibo) {
-		FreeImage_Unload(dibo);
-		dibo = NULL;
+	BYTE *q;
+	int x,y;
+	if (y1 >= 0) for(x = xa; x <= xb; x++) {
+		q = p0 + stride0*(h0-1-y1) + bypp0*x; // FreeImage хранит снизу вверх
+		frame_pixel(q, bypp0);
+	}
+	if (y2 < h0) for(x = xa; x <= xb; x++) {
+		q = p0 + stride0*(h0-1-y2) + bypp0*x;
+		frame_pixel(q, bypp0);
 	}
+	if (x1 >= 0) for(y = ya; y <= yb; y++) {
+		q = p0 + stride0*(h0-1-y) + bypp0*x1;
+		frame_pixel(q, bypp0);
+	}
+	if (x2 < w0) for(y = ya; y <= yb; y++) {
+		q = p0 + stride0*(h0-1-y) + bypp0*x2;
+		frame_pixel(q, bypp0);
+	}
+}
+/* }}} */
+
+// Параметры по умолчанию - как было зашито в Recognize()
+TRecognizeParams::TRecognizeParams() /* {{{ */
+{
+	min_size = 0;
+	max_size = 0;
+	step_policy = SQFACE_STEP_DEFAULT;
+	step = 1;
+	step_rel = 0.1;
+	min_stddev = 10.0;
+	min_face_stddev = 25.0;
+	flags = 0;
+	max_detections = 0;
+	min_neighbors = 0;
+	group_eps = 0.2;
+	nms_overlap = 0.0;
+	coarse_step = 3;
+	refine_depth = 4;
+	coarse_factor = 1.5;
+	scale_refine_depth = 12;
+	xscale_depth = 2;
+	xscale_cell = 4;
+	min_edge_density = 0.25;
+	max_edge_density = 1.25;
+	min_skin_fraction = 0.15;
+	n_rois = 0;
+	n_angles = 0;
+}
+/* }}} */
+
+TTrackParams::TTrackParams() /* {{{ */
+{
+	full_every = 10;
+	margin = 0.25;
+	scale_band = 1.25;
+}
+/* }}} */
 
-	if (dib1) {
-		FreeImage_Unload(dib1);
-		dib1 = NULL;
+// Посчитать окно и шаги для масштаба dscale
+void TFaceRecognizer::SetupScale(TScale *sc, float dscale, const TRecognizeParams *params) /* {{{ */
+{
+	sc->dscale = dscale;
+	for(int k = 0; k < MAX_W; k++) sc->a_ds[k] = (int)floor(k*dscale);
+	sc->window_w = (int)floor(cascades[scan[0]].window_w_mini*dscale);
+	sc->window_h = (int)floor(cascades[scan[0]].window_h_mini*dscale);
+	sc->inv = 1/float(sc->window_w*sc->window_h);
+
+	switch (params->step_policy) {
+		case SQFACE_STEP_FIXED:
+			sc->x_step = max(1,params->step);
+			sc->y_step = max(1,params->step);
+			break;
+		case SQFACE_STEP_RELATIVE:
+			sc->x_step = max(1,(int)(sc->window_w*params->step_rel));
+			sc->y_step = max(1,(int)(sc->window_h*params->step_rel));
+			break;
+		default:
+			sc->x_step = max(1,min(4,sc->window_w/10));
+			sc->y_step = max(1,min(4,sc->window_h/10));
+			break;
 	}
-	return 0;
 }
 /* }}} */
 
-// Распознать лица
-int TFaceRecognizer::Recognize(float factor) /* {{{ */
+// Прогнать окно через каскад c; вернуть число пройденных этапов
+// (c->n_stages - окно прошло все)
+// (*score - сумма этапов, включая последний, на котором отсеяли;
+// stage_margins, если не NULL - запас каждого этапа над его порогом)
+// (p2 или сжатая матрица - выбор один раз на окно, не на каждый прямоугольник)
+inline int TFaceRecognizer::EvalWindow(const TXMLCascade *c, const TScale *sc, int x1, int y1, float stddev, float *score, float *stage_margins) /* {{{ */
 {
-	for (int i_stage = 0; i_stage < cascade.n_stages; i_stage++) {
-		sqface_debug("stage %d: %d rects\n", i_stage+1, this->stages[i_stage].n_rects);
+	if (c->type == SQFACE_CASCADE_LBP) {
+		if (p2) return EvalLBP<0>(c, sc, x1, y1, score, stage_margins);
+		return EvalLBP<1>(c, sc, x1, y1, score, stage_margins);
 	}
-	clock_t t1 = clock();
-	// Перевести в градации серого
-	// Уменьшить картинку до других размеров, по этапам rescaling'а
-	float dscale = 1.0;
-	int i = 0;
-	int window_w = cascade.window_w_mini;
-	int window_h = cascade.window_h_mini;
-	// Можно сделать scaling по-убывающей, с наибольших квадратов
-	int count_window = 0;
-#define MAX_W 120
-	int a_ds[MAX_W]; // dscale
-	unsigned long long count_rect_total = 0;
-	unsigned long long count_rect_total_used = 0;
-	int i_face = 1;
-
-	if (cascade.n_stages == 0) {
-		sqface_debug("invalid or no cascade XML loaded\n");
-		return -1;
+	if (c->has_tilted) {
+		if (p2) return EvalStages<0,1>(c, sc, x1, y1, stddev, score, stage_margins);
+		return EvalStages<1,1>(c, sc, x1, y1, stddev, score, stage_margins);
 	}
+	if (p2) return EvalStages<0,0>(c, sc, x1, y1, stddev, score, stage_margins);
+	return EvalStages<1,0>(c, sc, x1, y1, stddev, score, stage_margins);
+}
+/* }}} */
 
-	do {
-		unsigned long long count_rect = 0;
-		for(int k = 0; k < MAX_W; k++) a_ds[k] = (int)floor(k*dscale);
-		float sum_cascade = 0;
-		i++;
-		window_w = (int)floor(cascade.window_w_mini*dscale);
-		window_h = (int)floor(cascade.window_h_mini*dscale);
-		float inv = 1/float(window_w*window_h);
-		int x1,y1,x2,y2;
-		int x_step = max(1,min(4,window_w/10));
-		int y_step = max(1,min(4,window_h/10));
-		for (y1 = 0; y1 <= h1-1-window_h; y1+=y_step) {
-			y2 = y1+window_h;
-			for (x1 = 0; x1 <= w1-1-window_w; x1+=x_step) {
-				x2 = x1+window_w;
-				float mean = f_sum1(x1,y1,window_w,window_h)*inv;
-				float variance = f_sum2(x1,y1,window_w,window_h)*inv - sqr(mean);
-				float stddev = 1.0;
-				if (variance > 0.0) stddev = sqrt(variance);
-				if(stddev < 10.0) continue;
-				// обработка "скользящего окна"
-				int f_failed = 0; // хотя бы один этап "провалил"
-				int f_passed = 0; // хотя бы один этап "прошел"
-				for (int i_stage = 0; i_stage < cascade.n_stages; i_stage++) {
-					float sum_stage = 0.0;
-					for (int i_feature_abs = this->stages[i_stage].i_feature_abs_1;
-							i_feature_abs <= this->stages[i_stage].i_feature_abs_2;
-							i_feature_abs++) {
-						int sum_feature = 0.0;
-						for (int i_rect_abs = this->features[i_feature_abs].i_rect_abs_1;
-								i_rect_abs <= this->features[i_feature_abs].i_rect_abs_2;
-								i_rect_abs++) {
-							int weight = (this->rects[i_rect_abs].weight);
-							// перенес сюда - уменьшил 42 -> 28 sec
-							int x_r_scaled = a_ds[this->rects[i_rect_abs].x];
-							int y_r_scaled = a_ds[this->rects[i_rect_abs].y];
-							int w_r_scaled = a_ds[this->rects[i_rect_abs].w];
-							int h_r_scaled = a_ds[this->rects[i_rect_abs].h];
-							int x_s = x1+x_r_scaled;
-							int y_s = y1+y_r_scaled;
-							sum_feature += (f_sum1(x_s,y_s,w_r_scaled,h_r_scaled)*weight);
-							count_rect_total_used++;
-						} // rects
-						float leafth = this->features[i_feature_abs].feature_threshold * stddev;
-
-						if (sum_feature*inv < leafth) sum_stage += this->features[i_feature_abs].left_val;
-						else sum_stage += this->features[i_feature_abs].right_val;
-
-						if (sum_stage > this->stages[i_stage].stage_threshold) {
-							f_passed = 1;
-							//break;
-						}
-					} // features
-					sum_cascade += (float)sum_stage;
-					if (sum_stage < this->stages[i_stage].stage_threshold) {
-						f_failed = 1;
+template <int SUM16, int TILTED>
+inline int TFaceRecognizer::EvalStages(const TXMLCascade *c, const TScale *sc, int x1, int y1, float stddev, float *score, float *stage_margins) /* {{{ */
+{
+	float sum_cascade = 0;
+	const TStage *stages = this->stages + c->i_stage_1;
+	for (int i_stage = 0; i_stage < c->n_stages; i_stage++) {
+		float sum_stage = 0.0;
+		for (int i_tree = stages[i_stage].i_feature_abs_1;
+				i_tree <= stages[i_stage].i_feature_abs_2;
+				i_tree += this->features[i_tree].n_nodes) {
+			// спуск по дереву от корня до листа ("пень" - один узел)
+			int i_feature_abs = i_tree;
+			for (;;) {
+				const TFeature *f = &this->features[i_feature_abs];
+				int sum_feature = 0.0;
+				for (int i_rect_abs = this->features[i_feature_abs].i_rect_abs_1;
+						i_rect_abs <= this->features[i_feature_abs].i_rect_abs_2;
+						i_rect_abs++) {
+					int weight = (this->rects[i_rect_abs].weight);
+					// перенес сюда - уменьшил 42 -> 28 sec
+					int x_r_scaled = sc->a_ds[this->rects[i_rect_abs].x];
+					int y_r_scaled = sc->a_ds[this->rects[i_rect_abs].y];
+					int w_r_scaled = sc->a_ds[this->rects[i_rect_abs].w];
+					int h_r_scaled = sc->a_ds[this->rects[i_rect_abs].h];
+					int x_s = x1+x_r_scaled;
+					int y_s = y1+y_r_scaled;
+					if (TILTED && f->tilted) {
+						sum_feature += t_sum(x_s,y_s,w_r_scaled,h_r_scaled)*weight;
+					} else {
+						sum_feature += ((SUM16 ? c_sum1(x_s,y_s,w_r_scaled,h_r_scaled) : f_sum1(x_s,y_s,w_r_scaled,h_r_scaled))*weight);
+					}
+					stats.n_rects++;
+				} // rects
+				float leafth = f->feature_threshold * stddev;
+
+				if (sum_feature*sc->inv < leafth) {
+					if (!f->left) {
+						sum_stage += f->left_val;
 						break;
 					}
-				}
-				if (f_failed == 0) {
-					sqface_debug("%d %d %d %d: [%f]\n", x1,y1,x2,y2, stddev);
-					if (stddev > 25.0) {
-						int x,y;
-						y = y1; for(x = x1; x <= x2; x++) {
-							p0[stride0*(h0-y)+bypp0*x+0] = 0xFF;
-							p0[stride0*(h0-y)+bypp0*x+1] = 0x3F;
-							p0[stride0*(h0-y)+bypp0*x+2] = 0x3F;
-						}
-						y = y2; for(x = x1; x <= x2; x++) {
-							p0[stride0*(h0-y)+bypp0*x+0] = 0xFF;
-							p0[stride0*(h0-y)+bypp0*x+1] = 0x3F;
-							p0[stride0*(h0-y)+bypp0*x+2] = 0x3F;
-						}
-						x = x1; for(y = y1; y <= y2; y++) {
-							p0[stride0*(h0-y)+bypp0*x+0] = 0xFF;
-							p0[stride0*(h0-y)+bypp0*x+1] = 0x3F;
-							p0[stride0*(h0-y)+bypp0*x+2] = 0x3F;
-						}
-						x = x2; for(y = y1; y <= y2; y++) {
-							p0[stride0*(h0-y)+bypp0*x+0] = 0xFF;
-							p0[stride0*(h0-y)+bypp0*x+1] = 0x3F;
-							p0[stride0*(h0-y)+bypp0*x+2] = 0x3F;
-						}
-						i_face++;
+					i_feature_abs += f->left;
+				} else {
+					if (!f->right) {
+						sum_stage += f->right_val;
+						break;
 					}
+					i_feature_abs += f->right;
 				}
-				count_rect += cascade.n_rects;
-				count_window++;
-			}
+			} // nodes
+		} // trees
+		sum_cascade += sum_stage;
+		if (stage_margins) stage_margins[i_stage] = sum_stage-stages[i_stage].stage_threshold;
+		if (sum_stage < stages[i_stage].stage_threshold) {
+			*score = sum_cascade;
+			return i_stage;
 		}
-		count_rect_total += count_rect;
-		sqface_debug("%d: %d x %d, scale = %.4f; windows = %d; rects = %llu (%llu)\n",
-				i,
-				window_w,
-				window_h,
-				dscale,
-				count_window,
-				count_rect_total,
-				count_rect_total_used
-			  );
+	}
+	*score = sum_cascade;
+	return c->n_stages;
+}
+/* }}} */
 
-		dscale *= factor;
-	} while(min(w1,h1) >= min(window_w,window_h));
+// Точка интегральной матрицы (p2 или сжатой), I(-1,y) = I(x,-1) = 0
+template <int SUM16>
+inline SUM_TYPE TFaceRecognizer::i_at(int x, int y) /* {{{ */
+{
+	if (x < 0 || y < 0) return 0;
+	return SUM16 ? c_at(x,y) : p2[w2*y + x];
+}
+/* }}} */
 
-	clock_t t2 = clock();
-	sqface_debug("%.4f seconds\n", (t2-t1)/(double)(CLOCKS_PER_SEC));
+// Прогнать окно через LBP-каскад: только целочисленные сравнения сумм
+// блоков, без нормировки на дисперсию
+template <int SUM16>
+inline int TFaceRecognizer::EvalLBP(const TXMLCascade *c, const TScale *sc, int x1, int y1, float *score, float *stage_margins) /* {{{ */
+{
+	float sum_cascade = 0;
+	const TStage *stages = this->stages + c->i_stage_1;
+	for (int i_stage = 0; i_stage < c->n_stages; i_stage++) {
+		float sum_stage = 0.0;
+		for (int i_node = stages[i_stage].i_feature_abs_1;
+				i_node <= stages[i_stage].i_feature_abs_2;
+				i_node++) {
+			const TLBPNode *n = &this->lbp_nodes[i_node];
+			const TRect *r = &this->rects[n->i_rect];
+			int bw = sc->a_ds[r->w];
+			int bh = sc->a_ds[r->h];
+			int x = x1+sc->a_ds[r->x]-1;
+			int y = y1+sc->a_ds[r->y]-1;
+
+			// 4x4 угла сетки блоков
+			SUM_TYPE p[4][4];
+			for (int j = 0; j < 4; j++) {
+				for (int i = 0; i < 4; i++) {
+					p[j][i] = i_at<SUM16>(x+i*bw, y+j*bh);
+				}
+			}
+#define LBP_BLOCK(i,j) (p[j+1][i+1] - p[j][i+1] - p[j+1][i] + p[j][i])
+			SUM_TYPE c = LBP_BLOCK(1,1);
+			int code =
+				((LBP_BLOCK(0,0) >= c) << 7) | // по часовой стрелке от левого верхнего
+				((LBP_BLOCK(1,0) >= c) << 6) |
+				((LBP_BLOCK(2,0) >= c) << 5) |
+				((LBP_BLOCK(2,1) >= c) << 4) |
+				((LBP_BLOCK(2,2) >= c) << 3) |
+				((LBP_BLOCK(1,2) >= c) << 2) |
+				((LBP_BLOCK(0,2) >= c) << 1) |
+				(LBP_BLOCK(0,1) >= c);
+#undef LBP_BLOCK
+			stats.n_rects += 9;
+
+			if (n->subset[code >> 5] & (1 << (code & 31))) sum_stage += n->left_val;
+			else sum_stage += n->right_val;
+		}
+		sum_cascade += sum_stage;
+		if (stage_margins) stage_margins[i_stage] = sum_stage-stages[i_stage].stage_threshold;
+		if (sum_stage < stages[i_stage].stage_threshold) {
+			*score = sum_cascade;
+			return i_stage;
+		}
+	}
+	*score = sum_cascade;
+	return c->n_stages;
+}
+/* }}} */
+
+// Запомнить найденное каскадом i_cascade лицо
+// (запасы этапов - в margins[n_faces*n_margins], заполняет вызывающий)
+int TFaceRecognizer::AddFace(int i_cascade, int x1, int y1, int x2, int y2, float score) /* {{{ */
+{
+	if (n_faces >= max_faces) {
+		TFace *p = (TFace *)ws->Grow(SQFACE_WS_FACES, 2*max_faces*sizeof(TFace));
+		float *m = (float *)ws->Grow(SQFACE_WS_MARGINS, 2*max_faces*n_margins*sizeof(float));
+		if (p) faces = p;
+		if (m) margins = m;
+		if (!p || !m) {
+			sqface_debug("No free memory.\n");
+			return -1;
+		}
+		max_faces = 2*max_faces;
+	}
+	TFace *face = &faces[n_faces];
+	face->raw = n_faces++;
+	face->depth = cascades[i_cascade].n_stages;
+	face->i_cascade = cascades[i_cascade].source;
+	face->parent = -1;
+	face->angle = cascades[i_cascade].rot*90;
+	face->x1 = x1;
+	face->y1 = y1;
+	face->x2 = x2;
+	face->y2 = y2;
+	face->f = 1;
+	face->score = score;
+	face->confidence = score-cascades[i_cascade].threshold_sum; // каждый этап пройден - не меньше 0
+	face->neighbors = 0;
+	stats.n_faces++;
 	return 0;
 }
 /* }}} */
 
+// Обработать одно "скользящее окно" всеми каскадами
+// (вернуть, сколько этапов оно прошло - наибольшее по каскадам)
+inline int TFaceRecognizer::ScanWindow(const TScale *sc, int x1, int y1, const TRecognizeParams *params) /* {{{ */
+{
+	int x2 = x1+sc->window_w;
+	int y2 = y1+sc->window_h;
+
+	stats.n_windows++;
+	float stddev = 1.0;
+	if (!scan_lbp || (params->flags & SQFACE_EDGE_PRUNING)) {
+		// LBP-каскадам дисперсия не нужна (только для SQFACE_EDGE_PRUNING)
+		float variance = WindowVariance(x1,y1,sc->window_w,sc->window_h,sc->inv);
+		if (variance > 0.0) stddev = sqrt(variance);
+		if (stddev < params->min_stddev) return 0;
+	}
+	if ((params->flags & SQFACE_SKIN_PREFILTER) && p5 &&
+			k_sum(x1,y1,sc->window_w,sc->window_h)*sc->inv < params->min_skin_fraction) {
+		return 0;
+	}
+	if (params->flags & SQFACE_EDGE_PRUNING) {
+		// границы на окно - как у лиц (гладкие и "шумные" окна - мимо)
+		float density = e_sum(x1,y1,sc->window_w,sc->window_h)*sc->inv/stddev;
+		if (density < params->min_edge_density) return 0;
+		if (params->max_edge_density > 0 && density > params->max_edge_density) return 0;
+	}
+
+	stats.n_windows_evaluated++;
+	int depth = 0;
+	float m[MAX_STAGES]; // запасы этапов - сразу, в лицо попадут только у прошедших
+	for (int k = 0; k < n_scan && !stop; k++) {
+		int i = scan[k];
+		const TXMLCascade *c = &cascades[i];
+		float score;
+		int d = EvalWindow(c, sc, x1, y1, stddev, &score, m);
+		if (d > depth) depth = d;
+		if (d < c->n_stages) continue;
+		sqface_debug("%d %d %d %d: [%f] cascade %d\n", x1,y1,x2,y2, stddev, i);
+		if (c->type == SQFACE_CASCADE_LBP || stddev > params->min_face_stddev) {
+			if (AddFace(i,x1,y1,x2,y2,score) < 0) {
+				stop = 1; // нет памяти
+				break;
+			}
+			memcpy(&margins[(n_faces-1)*n_margins], m, c->n_stages*sizeof(float));
+			if (params->flags & SQFACE_FIND_BIGGEST) stop = 1;
+			if (params->max_detections > 0 && n_faces >= params->max_detections) stop = 1;
+		}
+	}
+	if (record_hints > 0 && depth >= record_hints) {
+		AddHint(x1+sc->window_w/2, y1+sc->window_h/2);
+	}
+	return depth;
+}
+/* }}} */
+
+// Пройти все позиции окна на одном масштабе
+void TFaceRecognizer::ScanScale(TScale *sc, const TRecognizeParams *params) /* {{{ */
+{
+	if (!(params->flags & SQFACE_SCAN_COARSE_TO_FINE) || params->coarse_step <= 1) {
+		ScanGrid(sc, params, SQFACE_PASS_ALL);
+		return;
+	}
+
+	// Сначала редкая сетка с запоминанием глубины по каскаду, потом
+	// полная - только рядом с окнами, ушедшими по каскаду достаточно далеко
+	sc->cx_step = sc->x_step*params->coarse_step;
+	sc->cy_step = sc->y_step*params->coarse_step;
+	sc->n_cx = max(0,w1-1-sc->window_w)/sc->cx_step+1;
+	sc->n_cy = max(0,h1-1-sc->window_h)/sc->cy_step+1;
+	size_t n = (size_t)sc->n_cx*sc->n_cy;
+	sc->map = (BYTE *)ws->Reserve(SQFACE_WS_DEPTH, n);
+	BYTE *tmp = (BYTE *)ws->Reserve(SQFACE_WS_MASK, n);
+	if (!sc->map || !tmp) {
+		sqface_debug("No free memory, falling back to the full scan.\n");
+		ScanGrid(sc, params, SQFACE_PASS_ALL);
+		return;
+	}
+	memset(sc->map, 0, n);
+
+	ScanGrid(sc, params, SQFACE_PASS_COARSE);
+	if (stop) return;
+
+	// маска = (глубина >= refine_depth), расширенная на соседние узлы (3x3)
+	int n_cx = sc->n_cx, n_cy = sc->n_cy;
+	int th = params->refine_depth;
+	for (int j = 0; j < n_cy; j++) {
+		BYTE *d = sc->map + j*n_cx;
+		BYTE *t = tmp + j*n_cx;
+		for (int i = 0; i < n_cx; i++) {
+			t[i] = (d[i] >= th) ||
+				(i > 0 && d[i-1] >= th) ||
+				(i < n_cx-1 && d[i+1] >= th);
+		}
+	}
+	for (int j = 0; j < n_cy; j++) {
+		BYTE *d = sc->map + j*n_cx;
+		BYTE *t = tmp + j*n_cx;
+		for (int i = 0; i < n_cx; i++) {
+			d[i] = t[i] ||
+				(j > 0 && t[i-n_cx]) ||
+				(j < n_cy-1 && t[i+n_cx]);
+		}
+	}
+
+	ScanGrid(sc, params, SQFACE_PASS_FINE);
+}
+/* }}} */
+
+// Задевает ли окно (с краем - дисперсия по блокам sq_shift берет соседние
+// пиксели) блоки, измененные UpdateGray()
+int TFaceRecognizer::WindowChanged(int x1, int y1, int x2, int y2) /* {{{ */
+{
+	int pad = 1 << sq_shift;
+	int bx1 = max(0, (x1-pad) >> SQFACE_CHANGE_SHIFT);
+	int by1 = max(0, (y1-pad) >> SQFACE_CHANGE_SHIFT);
+	int bx2 = min(n_chx-1, (x2+pad) >> SQFACE_CHANGE_SHIFT);
+	int by2 = min(n_chy-1, (y2+pad) >> SQFACE_CHANGE_SHIFT);
+	if (bx1 > bx2 || by1 > by2) return 0;
+	const int *s1 = ch_sum + by1*(n_chx+1);
+	const int *s2 = ch_sum + (by2+1)*(n_chx+1);
+	return s2[bx2+1] - s1[bx2+1] - s2[bx1] + s1[bx1] > 0;
+}
+/* }}} */
+
+// Оставить от отрезков строки y1 только позиции окон, задевающих измененные
+// блоки (SQFACE_SCAN_CHANGED); вернуть, сколько отрезков осталось
+int TFaceRecognizer::KeepChanged(int *span_lo, int *span_hi, int n_spans, int y1, const TScale *sc) /* {{{ */
+{
+	int ch_lo[MAX_SPANS], ch_hi[MAX_SPANS];
+	int out_lo[MAX_SPANS], out_hi[MAX_SPANS];
+	int b = 1 << SQFACE_CHANGE_SHIFT;
+	int pad = 1 << sq_shift;
+	int by1 = max(0, (y1-pad) >> SQFACE_CHANGE_SHIFT);
+	int by2 = min(n_chy-1, (y1+sc->window_h+pad) >> SQFACE_CHANGE_SHIFT);
+	if (by1 > by2) return 0;
+	const int *s1 = ch_sum + by1*(n_chx+1);
+	const int *s2 = ch_sum + (by2+1)*(n_chx+1);
+	if (s2[n_chx] - s1[n_chx] == 0) return 0; // полоса строк не менялась
+
+	// столбцы блоков с изменениями в полосе - в отрезки позиций окна
+	int n = 0;
+	for (int bx = 0; bx < n_chx; bx++) {
+		if (s2[bx+1] - s1[bx+1] - s2[bx] + s1[bx] == 0) continue;
+		int lo = bx*b - sc->window_w - pad;
+		int hi = bx*b + b - 1 + pad;
+		if (n > 0 && lo <= ch_hi[n-1]+1) {
+			ch_hi[n-1] = hi;
+		} else if (n < MAX_SPANS) {
+			ch_lo[n] = lo;
+			ch_hi[n] = hi;
+			n++;
+		} else {
+			ch_hi[n-1] = hi; // с запасом
+		}
+	}
+
+	// пересечение двух упорядоченных наборов отрезков
+	int k = 0;
+	for (int i = 0, j = 0; i < n_spans && j < n; ) {
+		int lo = max(span_lo[i], ch_lo[j]);
+		int hi = min(span_hi[i], ch_hi[j]);
+		if (lo <= hi) {
+			if (k == MAX_SPANS) return n_spans; // не влезло - все окна строки
+			out_lo[k] = lo;
+			out_hi[k] = hi;
+			k++;
+		}
+		if (span_hi[i] < ch_hi[j]) i++;
+		else j++;
+	}
+	memcpy(span_lo, out_lo, k*sizeof(int));
+	memcpy(span_hi, out_hi, k*sizeof(int));
+	return k;
+}
+/* }}} */
+
+// Окно этого масштаба влезает в ROI и подходит по его размерам
+static inline int roi_fits(const TRoi *r, const TScale *sc) /* {{{ */
+{
+	if (r->w < sc->window_w || r->h < sc->window_h) return 0;
+	if (sc->window_w < r->min_size || sc->window_h < r->min_size) return 0;
+	if (r->max_size > 0 && (sc->window_w > r->max_size || sc->window_h > r->max_size)) return 0;
+	return 1;
+}
+/* }}} */
+
+// Пройти позиции окна одного прохода (только внутри ROI, если заданы)
+void TFaceRecognizer::ScanGrid(const TScale *sc, const TRecognizeParams *params, int pass) /* {{{ */
+{
+	int span_lo[MAX_SPANS], span_hi[MAX_SPANS];
+	int x_max = w1-1-sc->window_w;
+	int y_max = h1-1-sc->window_h;
+	int y_min = 0;
+	int n_found = n_faces; // найденные на прошлых масштабах
+	int x_step = sc->x_step;
+	int y_step = sc->y_step;
+
+	if (pass == SQFACE_PASS_COARSE) {
+		x_step = sc->cx_step;
+		y_step = sc->cy_step;
+	}
+
+	if (params->n_rois > 0) {
+		// строки, которые задевает хоть один ROI
+		int y_lo = y_max+1, y_hi = -1;
+		for (int i = 0; i < params->n_rois; i++) {
+			const TRoi *r = &params->rois[i];
+			if (!roi_fits(r, sc)) continue;
+			y_lo = min(y_lo, r->y);
+			y_hi = max(y_hi, r->y+r->h-sc->window_h);
+		}
+		y_min = max(0, y_lo);
+		y_max = min(y_max, y_hi);
+		y_min = (y_min+y_step-1)/y_step*y_step; // на общую сетку
+	}
+
+	for (int y1 = y_min; y1 <= y_max && !stop; y1 += y_step) {
+		int n_spans = 0;
+		if (params->n_rois == 0) {
+			span_lo[0] = 0;
+			span_hi[0] = x_max;
+			n_spans = 1;
+		} else {
+			// отрезки по x от ROI, в которые окно влезает целиком на этой строке,
+			// упорядочить и слить, чтобы перекрытия не сканировались дважды
+			for (int i = 0; i < params->n_rois; i++) {
+				const TRoi *r = &params->rois[i];
+				if (!roi_fits(r, sc) || y1 < r->y || y1+sc->window_h > r->y+r->h) continue;
+				int lo = max(0, r->x);
+				int hi = min(x_max, r->x+r->w-sc->window_w);
+				if (lo > hi) continue;
+				int j = n_spans++;
+				for (; j > 0 && span_lo[j-1] > lo; j--) {
+					span_lo[j] = span_lo[j-1];
+					span_hi[j] = span_hi[j-1];
+				}
+				span_lo[j] = lo;
+				span_hi[j] = hi;
+			}
+			int n = 0;
+			for (int i = 0; i < n_spans; i++) {
+				if (n > 0 && span_lo[i] <= span_hi[n-1]+1) {
+					span_hi[n-1] = max(span_hi[n-1], span_hi[i]);
+				} else {
+					span_lo[n] = span_lo[i];
+					span_hi[n] = span_hi[i];
+					n++;
+				}
+			}
+			n_spans = n;
+		}
+
+		if (scan_changed) {
+			n_spans = KeepChanged(span_lo, span_hi, n_spans, y1, sc);
+		}
+
+		if (params->flags & SQFACE_SKIP_FOUND) {
+			// не искать окна с центром внутри уже найденных лиц
+			int yc = y1+sc->window_h/2;
+			for (int i = 0; i < n_found && n_spans > 0; i++) {
+				const TFace *f = &faces[i];
+				if (yc < f->y1 || yc > f->y2) continue;
+				n_spans = CutSpan(span_lo, span_hi, n_spans,
+						f->x1-sc->window_w/2, f->x2-sc->window_w/2);
+			}
+		}
+
+		if (pass == SQFACE_PASS_COARSE) {
+			BYTE *d = sc->map + (y1/y_step)*sc->n_cx;
+			for (int i = 0; i < n_spans; i++) {
+				int x1 = (span_lo[i]+x_step-1)/x_step*x_step; // на общую сетку
+				for (; x1 <= span_hi[i] && !stop; x1 += x_step) {
+					d[x1/x_step] = ScanWindow(sc, x1, y1, params);
+				}
+			}
+		} else if (pass == SQFACE_PASS_FINE) {
+			// ближайший узел редкой сетки по y
+			int j = min((y1+sc->cy_step/2)/sc->cy_step, sc->n_cy-1);
+			BYTE *m = sc->map + j*sc->n_cx;
+			int y_coarse = (y1 % sc->cy_step == 0);
+			for (int i = 0; i < n_spans; i++) {
+				int x1 = (span_lo[i]+x_step-1)/x_step*x_step; // на общую сетку
+				for (; x1 <= span_hi[i] && !stop; x1 += x_step) {
+					if (y_coarse && x1 % sc->cx_step == 0) continue; // уже было
+					if (!m[min((x1+sc->cx_step/2)/sc->cx_step, sc->n_cx-1)]) continue;
+					ScanWindow(sc, x1, y1, params);
+				}
+			}
+		} else if (pass == SQFACE_PASS_ALL && xs_prev) {
+			// окно пропускается, если рядом с его центром на прошлом масштабе
+			// все окна отсеялись раньше xscale_depth этапов (0xFF - там не считали)
+			int yc = (y1+sc->window_h/2)/xs_cell;
+			const BYTE *p0 = xs_prev + max(0,yc-1)*xs_w;
+			const BYTE *p1 = xs_prev + yc*xs_w;
+			const BYTE *p2 = xs_prev + min(xs_h-1,yc+1)*xs_w;
+			BYTE *c = xs_cur + yc*xs_w;
+			int th = params->xscale_depth;
+			for (int i = 0; i < n_spans; i++) {
+				int x1 = (span_lo[i]+x_step-1)/x_step*x_step; // на общую сетку
+				for (; x1 <= span_hi[i] && !stop; x1 += x_step) {
+					int xc = (x1+sc->window_w/2)/xs_cell;
+					int xl = max(0,xc-1), xr = min(xs_w-1,xc+1);
+					int d = 0;
+					for (int k = xl; k <= xr; k++) {
+						d = max(d, max(p0[k], max(p1[k], p2[k])));
+					}
+					if (d < th) {
+						stats.n_windows_skipped++;
+						continue;
+					}
+					d = ScanWindow(sc, x1, y1, params);
+					if (c[xc] == 0xFF || d > c[xc]) c[xc] = d;
+				}
+			}
+		} else if (pass == SQFACE_PASS_MASK) {
+			BYTE *m = sc->map + (y1/y_step)*sc->n_cx;
+			for (int i = 0; i < n_spans; i++) {
+				int x1 = (span_lo[i]+x_step-1)/x_step*x_step; // на общую сетку
+				for (; x1 <= span_hi[i] && !stop; x1 += x_step) {
+					if (!m[x1/x_step]) continue;
+					ScanWindow(sc, x1, y1, params);
+				}
+			}
+		} else {
+			for (int i = 0; i < n_spans; i++) {
+				int x1 = (span_lo[i]+x_step-1)/x_step*x_step; // на общую сетку
+				for (; x1 <= span_hi[i] && !stop; x1 += x_step) {
+					ScanWindow(sc, x1, y1, params);
+				}
+			}
+		}
+	}
+}
+/* }}} */
+
+// Вырезать [lo,hi] из упорядоченных непересекающихся отрезков
+// (если отрезков слишком много - оставить как есть: лишнее сканирование, не пропуск)
+int TFaceRecognizer::CutSpan(int *span_lo, int *span_hi, int n_spans, int lo, int hi) /* {{{ */
+{
+	for (int i = 0; i < n_spans; i++) {
+		if (span_hi[i] < lo || span_lo[i] > hi) continue;
+		if (span_lo[i] < lo && span_hi[i] > hi) {
+			// дырка посередине - отрезок делится на два
+			if (n_spans >= MAX_SPANS) return n_spans;
+			for (int j = n_spans; j > i+1; j--) {
+				span_lo[j] = span_lo[j-1];
+				span_hi[j] = span_hi[j-1];
+			}
+			span_lo[i+1] = hi+1;
+			span_hi[i+1] = span_hi[i];
+			span_hi[i] = lo-1;
+			return n_spans+1;
+		}
+		if (span_lo[i] >= lo && span_hi[i] <= hi) {
+			// накрыт целиком
+			for (int j = i; j < n_spans-1; j++) {
+				span_lo[j] = span_lo[j+1];
+				span_hi[j] = span_hi[j+1];
+			}
+			n_spans--;
+			i--;
+			continue;
+		}
+		if (span_lo[i] < lo) span_hi[i] = lo-1;
+		else span_lo[i] = hi+1;
+	}
+	return n_spans;
+}
+/* }}} */
+
+// Ключ окна в хэш-сетке: октава размера и ячейка (четверть октавы) левого верхнего угла
+static inline void group_key(int x, int y, int w, int *ks, int *kx, int *ky) /* {{{ */
+{
+	int s = 0;
+	while ((2 << s) <= w) s++;
+	int cell = max(1, (1 << s) >> 2);
+	*ks = s;
+	*kx = x/cell;
+	*ky = y/cell;
+}
+/* }}} */
+
+static inline unsigned int group_hash(int ks, int kx, int ky) /* {{{ */
+{
+	return ((unsigned int)ks*73856093u) ^ ((unsigned int)kx*19349663u) ^ ((unsigned int)ky*83492791u);
+}
+/* }}} */
+
+static inline int group_find(TGroupItem *items, int i) /* {{{ */
+{
+	while (items[i].parent != i) {
+		items[i].parent = items[items[i].parent].parent;
+		i = items[i].parent;
+	}
+	return i;
+}
+/* }}} */
+
+// Сгруппировать перекрывающиеся окна (как groupRectangles() в OpenCV:
+// "похожие" - углы отличаются не больше чем на eps от размера), оставить
+// группы больше min_neighbors. Соседей ищем через хэш-сетку по октаве
+// размера и положению, так что на тысячах окон это почти линейно.
+// (группы из src[n] - в dst, места там не меньше n; raw - номер в src)
+int TFaceRecognizer::GroupWindows(const TFace *src, int n, TFace *dst, const TRecognizeParams *params) /* {{{ */
+{
+	float eps = params->group_eps;
+	unsigned int n_heads = 1;
+	while (n_heads < 2*(unsigned int)n) n_heads <<= 1;
+
+	size_t size = n*sizeof(TGroupItem) + n_heads*sizeof(int);
+	TGroupItem *items = (TGroupItem *)ws->Reserve(SQFACE_WS_GROUP, size);
+	if (!items) {
+		sqface_debug("No free memory.\n");
+		return -1;
+	}
+	int *heads = (int *)(items+n);
+	for (unsigned int i = 0; i < n_heads; i++) heads[i] = -1;
+
+	for (int i = 0; i < n; i++) {
+		const TFace *a = &src[i];
+		int w = a->x2-a->x1, h = a->y2-a->y1;
+		items[i].parent = i;
+
+		// ключ - по большей стороне m (окна бывают и не квадратные): у похожих
+		// и ширина, и высота отличаются не больше чем на 2*delta <= 2*eps*m,
+		// значит и большая сторона
+		int m = max(w,h);
+		int s_lo, s_hi, kx, ky;
+		group_key(0, 0, max(1,(int)(m*(1-2*eps))), &s_lo, &kx, &ky);
+		group_key(0, 0, (int)(m*(1+2*eps))+1, &s_hi, &kx, &ky);
+		float delta_max = eps*m; // delta = eps*(min(w)+min(h))/2 <= eps*max(w,h)
+
+		for (int s = s_lo; s <= s_hi; s++) {
+			int cell = max(1, (1 << s) >> 2);
+			int r = (int)(delta_max/cell)+1;
+			int cx = a->x1/cell, cy = a->y1/cell;
+			for (int yy = cy-r; yy <= cy+r; yy++) {
+				for (int xx = cx-r; xx <= cx+r; xx++) {
+					int j = heads[group_hash(s, xx, yy) & (n_heads-1)];
+					for (; j >= 0; j = items[j].next) {
+						if (items[j].ks != s || items[j].kx != xx || items[j].ky != yy) continue;
+						const TFace *b = &src[j];
+						if (b->i_cascade != a->i_cascade || b->angle != a->angle) continue; // группы - по каскадам и наклонам
+						int wb = b->x2-b->x1, hb = b->y2-b->y1;
+						float delta = eps*(min(w,wb)+min(h,hb))*0.5;
+						if (abs(a->x1-b->x1) <= delta && abs(a->y1-b->y1) <= delta &&
+								abs(a->x2-b->x2) <= delta && abs(a->y2-b->y2) <= delta) {
+							int ra = group_find(items, i), rb = group_find(items, j);
+							if (ra != rb) items[max(ra,rb)].parent = min(ra,rb);
+						}
+					}
+				}
+			}
+		}
+
+		group_key(a->x1, a->y1, m, &items[i].ks, &items[i].kx, &items[i].ky);
+		unsigned int hv = group_hash(items[i].ks, items[i].kx, items[i].ky) & (n_heads-1);
+		items[i].next = heads[hv];
+		heads[hv] = i;
+	}
+
+	// суммы по группам - в dst[корень]
+	for (int i = 0; i < n; i++) {
+		dst[i].f = 0;
+		dst[i].x1 = dst[i].y1 = dst[i].x2 = dst[i].y2 = 0;
+		dst[i].score = 0;
+		dst[i].confidence = 0;
+		dst[i].neighbors = 0;
+		dst[i].depth = 0;
+		dst[i].raw = i;
+		dst[i].i_cascade = src[i].i_cascade;
+		dst[i].parent = src[i].parent;
+		dst[i].angle = src[i].angle;
+	}
+	for (int i = 0; i < n; i++) {
+		TFace *g = &dst[group_find(items, i)];
+		const TFace *a = &src[i];
+		g->x1 += a->x1;
+		g->y1 += a->y1;
+		g->x2 += a->x2;
+		g->y2 += a->y2;
+		if (g->neighbors == 0 || a->score > g->score) {
+			g->score = a->score;
+			g->raw = i;
+		}
+		g->depth = max(g->depth, a->depth);
+		g->confidence += a->confidence;
+		g->neighbors++;
+	}
+
+	// средние прямоугольники групп, в которых больше min_neighbors окон
+	int n_groups = 0;
+	for (int i = 0; i < n; i++) {
+		TFace *g = &dst[i];
+		if (g->neighbors <= params->min_neighbors) continue;
+		TFace *o = &dst[n_groups++]; // o <= g, корень раньше своих окон
+		int k = g->neighbors;
+		o->x1 = (2*g->x1+k)/(2*k);
+		o->y1 = (2*g->y1+k)/(2*k);
+		o->x2 = (2*g->x2+k)/(2*k);
+		o->y2 = (2*g->y2+k)/(2*k);
+		o->f = 1;
+		o->score = g->score;
+		o->confidence = g->confidence;
+		o->neighbors = k;
+		o->depth = g->depth;
+		o->raw = g->raw;
+		o->i_cascade = g->i_cascade;
+		o->parent = g->parent;
+		o->angle = g->angle;
+	}
+	sqface_debug("%d raw windows -> %d groups\n", n, n_groups);
+	return n_groups;
+}
+/* }}} */
+
+// Сгруппировать найденные окна в groups (результат - они)
+int TFaceRecognizer::GroupFaces(const TRecognizeParams *params) /* {{{ */
+{
+	groups = (TFace *)ws->Reserve(SQFACE_WS_GROUPS, n_faces*sizeof(TFace));
+	if (!groups) {
+		sqface_debug("No free memory.\n");
+		return -1;
+	}
+	int n_groups = GroupWindows(faces, n_faces, groups, params);
+	if (n_groups < 0) return -1;
+	result = groups;
+	n_result = n_groups;
+	return n_groups;
+}
+/* }}} */
+
+// Подавить лица, перекрытые (IoU > overlap) более уверенными того же каскада и наклона;
+// сами окна (и их запасы по номерам) не трогать - без группировки работать на копии в groups
+int TFaceRecognizer::SuppressFaces(float overlap) /* {{{ */
+{
+	if (result == faces) {
+		groups = (TFace *)ws->Reserve(SQFACE_WS_GROUPS, n_result*sizeof(TFace));
+		if (!groups) {
+			sqface_debug("No free memory.\n");
+			return -1;
+		}
+		memcpy(groups, faces, n_result*sizeof(TFace));
+		result = groups;
+	}
+
+	// по убыванию уверенности (вставками - лиц после группировки немного)
+	for (int i = 1; i < n_result; i++) {
+		TFace t = result[i];
+		int j = i;
+		for (; j > 0 && result[j-1].confidence < t.confidence; j--) result[j] = result[j-1];
+		result[j] = t;
+	}
+
+	int n = 0;
+	for (int i = 0; i < n_result; i++) {
+		const TFace *a = &result[i];
+		int keep = 1;
+		for (int j = 0; j < n && keep; j++) {
+			const TFace *b = &result[j];
+			if (b->i_cascade != a->i_cascade || b->angle != a->angle) continue;
+			int iw = min(a->x2,b->x2)-max(a->x1,b->x1);
+			int ih = min(a->y2,b->y2)-max(a->y1,b->y1);
+			if (iw <= 0 || ih <= 0) continue;
+			float inter = (float)iw*ih;
+			float uni = (float)(a->x2-a->x1)*(a->y2-a->y1)+(float)(b->x2-b->x1)*(b->y2-b->y1)-inter;
+			if (inter > overlap*uni) keep = 0;
+		}
+		if (keep) result[n++] = *a;
+	}
+	n_result = n;
+	return n;
+}
+/* }}} */
+
+// Уменьшить картинку до других размеров, по этапам rescaling'а:
+// масштабы от dscale с шагом factor, на которых окно еще влезает в картинку
+int TFaceRecognizer::BuildScales(float dscale, float factor, const TRecognizeParams *params, float *scales, int max_scales) /* {{{ */
+{
+	int n_scales = 0;
+
+	while (n_scales < max_scales) {
+		int window_w = (int)floor(cascades[scan[0]].window_w_mini*dscale);
+		int window_h = (int)floor(cascades[scan[0]].window_h_mini*dscale);
+		if (min(window_w,window_h) > min(w1,h1)) break;
+		if (params->max_size > 0 && (window_w > params->max_size || window_h > params->max_size)) break;
+		if (window_w >= params->min_size && window_h >= params->min_size) {
+			scales[n_scales++] = dscale;
+		}
+		dscale *= factor;
+	}
+	return n_scales;
+}
+/* }}} */
+
+// Запомнить окно, глубоко прошедшее каскад на грубом масштабе
+void TFaceRecognizer::AddHint(int xc, int yc) /* {{{ */
+{
+	if (n_hints >= max_hints) {
+		int n = max_hints ? 2*max_hints : START_FACES;
+		THint *p = (THint *)ws->Grow(SQFACE_WS_HINTS, n*sizeof(THint));
+		if (!p) return; // не уточнять - хуже, но не ошибка
+		hints = p;
+		max_hints = n;
+	}
+	hints[n_hints].xc = xc;
+	hints[n_hints].yc = yc;
+	n_hints++;
+}
+/* }}} */
+
+// Грубые масштабы (coarse_factor) целиком, потом промежуточные (factor) -
+// только вокруг окон, глубоко прошедших каскад на соседних грубых масштабах
+void TFaceRecognizer::RecognizeRefined(float factor, const TRecognizeParams *params, int largest_first) /* {{{ */
+{
+	float coarse[MAX_SCALES];
+	int hint_lo[MAX_SCALES], hint_hi[MAX_SCALES]; // подсказки грубого масштаба k
+	float fine[MAX_SCALES];
+	int fine_k1[MAX_SCALES], fine_k2[MAX_SCALES];
+	int n_coarse, n_fine = 0;
+	TScale sc;
+
+	n_coarse = BuildScales(1.0, params->coarse_factor, params, coarse, MAX_SCALES);
+	if (n_coarse == 0) return;
+
+	n_hints = 0;
+	record_hints = max(1,params->scale_refine_depth);
+	for (int i = 0; i < n_coarse && !stop; i++) {
+		int k = largest_first ? n_coarse-1-i : i;
+		hint_lo[k] = n_hints;
+		SetupScale(&sc, coarse[k], params);
+		ScanScale(&sc, params);
+		hint_hi[k] = n_hints;
+		stats.n_scales++;
+	}
+	record_hints = 0;
+	if (stop) return;
+
+	// промежуточные масштабы: ниже первого грубого и между соседними грубыми
+	float lo = coarse[0];
+	float f_stop = sqrt(factor); // не ставить почти совпадающие с грубыми
+	float dscale;
+	for (dscale = lo/factor; dscale >= 1.0 && n_fine < MAX_SCALES; dscale /= factor) {
+		int window_w = (int)floor(cascades[scan[0]].window_w_mini*dscale);
+		int window_h = (int)floor(cascades[scan[0]].window_h_mini*dscale);
+		if (window_w < params->min_size || window_h < params->min_size) break;
+		fine[n_fine] = dscale;
+		fine_k1[n_fine] = 0;
+		fine_k2[n_fine] = 0;
+		n_fine++;
+	}
+	// (сверху вниз получились - развернуть)
+	for (int i = 0; i < n_fine/2; i++) {
+		float t = fine[i]; fine[i] = fine[n_fine-1-i]; fine[n_fine-1-i] = t;
+	}
+	for (int k = 0; k < n_coarse && n_fine < MAX_SCALES; k++) {
+		float hi = (k+1 < n_coarse) ? coarse[k+1]/f_stop : 0;
+		float s_list[MAX_SCALES];
+		int n = BuildScales(coarse[k]*factor, factor, params, s_list, MAX_SCALES);
+		for (int i = 0; i < n && n_fine < MAX_SCALES; i++) {
+			if (hi > 0 && s_list[i] >= hi) break;
+			fine[n_fine] = s_list[i];
+			fine_k1[n_fine] = k;
+			fine_k2[n_fine] = min(k+1, n_coarse-1);
+			n_fine++;
+		}
+	}
+
+	for (int i = 0; i < n_fine && !stop; i++) {
+		int j = largest_first ? n_fine-1-i : i;
+		SetupScale(&sc, fine[j], params);
+		if (PrepareHintMask(&sc, hint_lo, hint_hi, fine_k1[j], fine_k2[j]) > 0) {
+			ScanGrid(&sc, params, SQFACE_PASS_MASK);
+		}
+		stats.n_scales++;
+	}
+}
+/* }}} */
+
+// Маска позиций окна масштаба sc вокруг подсказок грубых масштабов k1..k2;
+// вернуть число подсказок
+int TFaceRecognizer::PrepareHintMask(TScale *sc, const int *hint_lo, const int *hint_hi, int k1, int k2) /* {{{ */
+{
+	int x_max = w1-1-sc->window_w;
+	int y_max = h1-1-sc->window_h;
+	if (x_max < 0 || y_max < 0) return 0;
+
+	sc->cx_step = sc->x_step;
+	sc->cy_step = sc->y_step;
+	sc->n_cx = x_max/sc->x_step+1;
+	sc->n_cy = y_max/sc->y_step+1;
+	size_t n = (size_t)sc->n_cx*sc->n_cy;
+	sc->map = (BYTE *)ws->Reserve(SQFACE_WS_MASK, n);
+	if (!sc->map) return 0;
+	memset(sc->map, 0, n);
+
+	// центр окна - в пределах четверти окна (и шага) от центра подсказки
+	int margin_x = sc->window_w/4+sc->x_step;
+	int margin_y = sc->window_h/4+sc->y_step;
+	int count = 0;
+	for (int k = k1; k <= k2; k++) {
+		for (int h = hint_lo[k]; h < hint_hi[k]; h++) {
+			int i1 = max(0, (hints[h].xc-margin_x-sc->window_w/2+sc->x_step-1)/sc->x_step);
+			int i2 = min(sc->n_cx-1, (hints[h].xc+margin_x-sc->window_w/2)/sc->x_step);
+			int j1 = max(0, (hints[h].yc-margin_y-sc->window_h/2+sc->y_step-1)/sc->y_step);
+			int j2 = min(sc->n_cy-1, (hints[h].yc+margin_y-sc->window_h/2)/sc->y_step);
+			if (i1 > i2) continue;
+			for (int j = j1; j <= j2; j++) {
+				memset(sc->map + (size_t)j*sc->n_cx + i1, 1, i2-i1+1);
+			}
+			count++;
+		}
+	}
+	return count;
+}
+/* }}} */
+
+// Карты глубины для SQFACE_SCAN_XSCALE_HINTS: ячейки xscale_cell пикселей
+// по центру окна, в каждой - наибольшая глубина окон масштаба с центром в ней
+int TFaceRecognizer::PrepareXScale(const TRecognizeParams *params) /* {{{ */
+{
+	xs_prev = NULL;
+	xs_cur = NULL;
+	if (!(params->flags & SQFACE_SCAN_XSCALE_HINTS) || params->xscale_depth <= 0) return 0;
+
+	xs_cell = max(1, params->xscale_cell);
+	xs_w = w1/xs_cell+1;
+	xs_h = h1/xs_cell+1;
+	size_t n = (size_t)xs_w*xs_h;
+	BYTE *p = (BYTE *)ws->Reserve(SQFACE_WS_XSCALE, 2*n);
+	if (!p) return -1;
+	memset(p, 0xFF, 2*n); // первый масштаб - целиком
+	xs_prev = p;
+	xs_cur = p+n;
+	return 0;
+}
+/* }}} */
+
+// Каскады одного прохода: все верхние (i_sub < 0; повернутые копии - те,
+// что есть в rotations, SQFACE_ROTATE_*) или один дочерний
+void TFaceRecognizer::SetScan(int i_sub, int rotations) /* {{{ */
+{
+	n_scan = 0;
+	scan_lbp = 1;
+	for (int i = 0; i < n_cascades; i++) {
+		if (i_sub >= 0 ? i != i_sub : cascades[i].parent >= 0) continue;
+		if (i_sub < 0 && cascades[i].rot && !(rotations & (SQFACE_ROTATE_90 << (cascades[i].rot-1)))) continue;
+		scan[n_scan++] = i;
+		if (cascades[i].type != SQFACE_CASCADE_LBP) scan_lbp = 0;
+	}
+}
+/* }}} */
+
+// Дочерние каскады: в каждом найденном (не наклоненном) лице родителя - только ROI каскада,
+// на масштабах окна min_rel..max_rel ширины лица, по тем же матрицам.
+// Окна группируются по лицу так же, как лица (min_neighbors); фильтры
+// SQFACE_EDGE_PRUNING и SQFACE_SKIN_PREFILTER настроены на лица - без них
+int TFaceRecognizer::RecognizeParts(float factor, const TRecognizeParams *params) /* {{{ */
+{
+	float scales[MAX_SCALES];
+	TScale sc;
+	TRecognizeParams p = *params;
+	p.flags &= ~(SQFACE_FIND_BIGGEST | SQFACE_SKIP_FOUND | SQFACE_SCAN_XSCALE_HINTS |
+			SQFACE_EDGE_PRUNING | SQFACE_SKIN_PREFILTER);
+	p.max_detections = 0;
+	p.n_rois = 1;
+
+	int in_faces = (result == faces); // faces может переехать при росте
+	for (int i_sub = 0; i_sub < n_cascades; i_sub++) {
+		const TXMLCascade *c = &cascades[i_sub];
+		if (c->parent < 0) continue;
+		SetScan(i_sub);
+		// размеры окна (по ширине лица) - в ограничения на его стороны
+		float side_min = (float)min(c->window_w_mini, c->window_h_mini)/c->window_w_mini;
+		float side_max = (float)max(c->window_w_mini, c->window_h_mini)/c->window_w_mini;
+		for (int i = 0; i < n_result; i++) {
+			const TFace *f = &result[i];
+			if (f->i_cascade != c->parent || f->angle != 0) continue;
+			int fw = f->x2-f->x1, fh = f->y2-f->y1;
+			TRoi *r = &p.rois[0];
+			r->x = f->x1+(int)(c->roi[0]*fw);
+			r->y = f->y1+(int)(c->roi[1]*fh);
+			r->w = (int)((c->roi[2]-c->roi[0])*fw);
+			r->h = (int)((c->roi[3]-c->roi[1])*fh);
+			r->min_size = r->max_size = 0;
+			p.min_size = (int)(c->min_rel*fw*side_min);
+			p.max_size = max(1, (int)(c->max_rel*fw*side_max));
+
+			int n0 = n_faces;
+			stop = 0;
+			int n_scales = BuildScales(1.0, factor, &p, scales, MAX_SCALES);
+			for (int k = 0; k < n_scales && !stop; k++) {
+				SetupScale(&sc, scales[k], &p);
+				ScanScale(&sc, &p);
+				stats.n_scales++;
+			}
+			if (in_faces) result = faces;
+			if (AddParts(i, n0, &p) < 0) {
+				SetScan(-1, params->flags & SQFACE_ROTATE_ALL);
+				return -1;
+			}
+		}
+	}
+	SetScan(-1, params->flags & SQFACE_ROTATE_ALL);
+	sqface_debug("%d parts\n", n_parts);
+	return n_parts;
+}
+/* }}} */
+
+// Окна faces[n0..n_faces) дочернего каскада в лице i - в части
+int TFaceRecognizer::AddParts(int i, int n0, const TRecognizeParams *params) /* {{{ */
+{
+	int n = n_faces-n0;
+	if (n <= 0) return 0;
+	if (n_parts+n > max_parts) {
+		int m = max(max_parts ? 2*max_parts : START_FACES, n_parts+n);
+		TFace *q = (TFace *)ws->Grow(SQFACE_WS_PARTS, m*sizeof(TFace));
+		if (!q) {
+			sqface_debug("No free memory.\n");
+			return -1;
+		}
+		parts = q;
+		max_parts = m;
+	}
+	for (int k = n0; k < n_faces; k++) faces[k].parent = i;
+
+	TFace *dst = parts+n_parts;
+	if (params->min_neighbors > 0) {
+		int n_groups = GroupWindows(faces+n0, n, dst, params);
+		if (n_groups < 0) return -1;
+		for (int k = 0; k < n_groups; k++) dst[k].raw += n0;
+		n_parts += n_groups;
+	} else {
+		memcpy(dst, faces+n0, n*sizeof(TFace));
+		n_parts += n;
+	}
+	return 0;
+}
+/* }}} */
+
+// Все масштабы одного прохода (по текущим матрицам и каскадам SetScan())
+void TFaceRecognizer::ScanScales(float factor, const TRecognizeParams *params, int largest_first) /* {{{ */
+{
+	float scales[MAX_SCALES];
+	int n_scales = 0;
+	TScale sc;
+
+	if ((params->flags & SQFACE_SCAN_SCALE_REFINE) && params->coarse_factor > factor) {
+		RecognizeRefined(factor, params, largest_first);
+	} else {
+		if (PrepareXScale(params) < 0) {
+			sqface_debug("No free memory, scanning without cross-scale hints.\n");
+		}
+		n_scales = BuildScales(1.0, factor, params, scales, MAX_SCALES);
+		for (int i = 0; i < n_scales && !stop; i++) {
+			SetupScale(&sc, scales[largest_first ? n_scales-1-i : i], params);
+			ScanScale(&sc, params);
+			stats.n_scales++;
+			if (xs_prev) {
+				// текущая карта становится прошлой; пропущенные окна
+				// остаются 0xFF - на следующем масштабе их проверят
+				BYTE *t = xs_prev;
+				xs_prev = xs_cur;
+				xs_cur = t;
+				memset(xs_cur, 0xFF, (size_t)xs_w*xs_h);
+			}
+			sqface_debug("%d: %d x %d, scale = %.4f; windows = %llu; rects = %llu\n",
+					i+1,
+					sc.window_w,
+					sc.window_h,
+					sc.dscale,
+					stats.n_windows_evaluated,
+					stats.n_rects
+				  );
+		}
+		xs_prev = NULL;
+	}
+}
+/* }}} */
+
+// Проход по повернутой копии "серой" картинки: лица, наклоненные на angle
+// градусов по часовой, на ней стоят прямо. Копия - в границах повернутой
+// картинки (за краем - ближайший пиксель), матрицы строятся по ней один раз
+// на все масштабы. Найденные окна переводятся обратно по центру (рамка -
+// того же размера), наклон - в TFace::angle. Матрицы исходной картинки
+// после этого надо построить заново (это делает Recognize())
+int TFaceRecognizer::ScanRotated(const BYTE *src, int sw, int sh, int sstride, float angle, float factor, const TRecognizeParams *params, int largest_first) /* {{{ */
+{
+	float a = angle*M_PI/180, ca = cos(a), sa = sin(a);
+	int w = (int)ceil(fabs(sw*ca)+fabs(sh*sa));
+	int h = (int)ceil(fabs(sw*sa)+fabs(sh*ca));
+	if (w > 65535 || h > 65535) return -1;
+	BYTE *dst = (BYTE *)ws->Reserve(SQFACE_WS_ROTATED, (size_t)w*h);
+	if (!dst) {
+		sqface_debug("No free memory.\n");
+		return -1;
+	}
+	float cx = sw*0.5, cy = sh*0.5, cx2 = w*0.5, cy2 = h*0.5;
+
+	// точка копии p' -> исходной картинки c + R(angle)(p'-c'), билинейно
+	for (int y = 0; y < h; y++) {
+		float dy = y+0.5-cy2;
+		float sx = cx+(0.5-cx2)*ca-dy*sa-0.5;
+		float sy = cy+(0.5-cx2)*sa+dy*ca-0.5;
+		BYTE *d = dst + (size_t)w*y;
+		for (int x = 0; x < w; x++, sx += ca, sy += sa) {
+			int ix = (int)floor(sx), iy = (int)floor(sy);
+			int fx = (int)((sx-ix)*256), fy = (int)((sy-iy)*256);
+			int x0 = min(max(ix,0),sw-1), x1 = min(max(ix+1,0),sw-1);
+			int y0 = min(max(iy,0),sh-1), y1 = min(max(iy+1,0),sh-1);
+			const BYTE *r0 = src + (size_t)sstride*y0, *r1 = src + (size_t)sstride*y1;
+			int t = r0[x0]*(256-fx) + r0[x1]*fx;
+			int b = r1[x0]*(256-fx) + r1[x1]*fx;
+			d[x] = (BYTE)((t*(256-fy) + b*fy + (1 << 15)) >> 16);
+		}
+	}
+
+	p1 = dst;
+	w1 = w;
+	h1 = h;
+	stride1 = w;
+	bypp1 = 1;
+	if (BuildIntegrals() < 0) return -1;
+	if ((params->flags & SQFACE_EDGE_PRUNING) && BuildEdgeIntegral() < 0) return -1;
+	for (int i = 0; i < n_scan && !p6; i++) {
+		if (cascades[scan[i]].has_tilted && BuildTiltedIntegral() < 0) return -1;
+	}
+
+	// ROI - рамками их повернутых углов; уже найденные лица и маска кожи
+	// (по исходной "цветной" картинке) здесь ни при чем
+	TRecognizeParams p = *params;
+	p.flags &= ~(SQFACE_SKIP_FOUND | SQFACE_SKIN_PREFILTER);
+	for (int i = 0; i < p.n_rois; i++) {
+		const TRoi *r = &params->rois[i];
+		float x_lo = w, y_lo = h, x_hi = 0, y_hi = 0;
+		for (int k = 0; k < 4; k++) {
+			float dx = r->x+(k & 1)*r->w-cx, dy = r->y+(k >> 1)*r->h-cy;
+			float x = cx2+dx*ca+dy*sa, y = cy2-dx*sa+dy*ca;
+			x_lo = min(x_lo, x); x_hi = max(x_hi, x);
+			y_lo = min(y_lo, y); y_hi = max(y_hi, y);
+		}
+		p.rois[i].x = (int)x_lo;
+		p.rois[i].y = (int)y_lo;
+		p.rois[i].w = (int)ceil(x_hi)-p.rois[i].x;
+		p.rois[i].h = (int)ceil(y_hi)-p.rois[i].y;
+	}
+
+	// окна - обратно на исходную картинку: у края копии (ее углы - вне
+	// картинки) рамка может вылезти - обрезать, а от которых осталось
+	// меньше половины - выкинуть (со сдвигом запасов)
+	int n0 = n_faces;
+	ScanScales(factor, &p, largest_first);
+	int n = n0;
+	for (int i = n0; i < n_faces; i++) {
+		TFace *f = &faces[i];
+		float dx = (f->x1+f->x2)*0.5-cx2, dy = (f->y1+f->y2)*0.5-cy2;
+		int xc = (int)floor(cx+dx*ca-dy*sa+0.5), yc = (int)floor(cy+dx*sa+dy*ca+0.5);
+		int fw = f->x2-f->x1, fh = f->y2-f->y1;
+		int x1 = xc-fw/2, y1 = yc-fh/2;
+		int x2 = x1+fw, y2 = y1+fh;
+		x1 = max(x1, 0); y1 = max(y1, 0);
+		x2 = min(x2, sw); y2 = min(y2, sh);
+		if (x2 <= x1 || y2 <= y1 || 2*(x2-x1)*(y2-y1) < fw*fh) continue;
+		f->x1 = x1;
+		f->y1 = y1;
+		f->x2 = x2;
+		f->y2 = y2;
+		f->angle += angle;
+		if (n != i) {
+			faces[n] = *f;
+			memcpy(margins+n*n_margins, margins+i*n_margins, n_margins*sizeof(float));
+		}
+		faces[n].raw = n;
+		n++;
+	}
+	sqface_debug("angle %.1f: %dx%d, %d windows (%d outside)\n", angle, w, h, n-n0, n_faces-n);
+	stats.n_faces -= n_faces-n;
+	n_faces = n;
+	return 0;
+}
+/* }}} */
+
+// Распознать лица
+int TFaceRecognizer::Recognize(float factor) /* {{{ */
+{
+	return Recognize(factor, NULL);
+}
+/* }}} */
+
+int TFaceRecognizer::Recognize(float factor, const TRecognizeParams *params) /* {{{ */
+{
+	TRecognizeParams params_default;
+	int rotated = 0;
+
+	if (!params) params = &params_default;
+
+	for (int i = 0; i < n_cascades; i++) {
+		for (int i_stage = 0; i_stage < cascades[i].n_stages; i_stage++) {
+			sqface_debug("cascade %d stage %d: %d rects\n", i, i_stage+1, this->stages[cascades[i].i_stage_1+i_stage].n_rects);
+		}
+	}
+	clock_t t1 = clock();
+
+	if (n_cascades == 0) {
+		sqface_debug("invalid or no cascade XML loaded\n");
+		return -1;
+	}
+
+	ClaimWorkspace();
+	if ((!p2 && !c_local) || !p3) {
+		sqface_debug("no image loaded\n");
+		return -1;
+	}
+
+	if (factor <= 1.0) {
+		sqface_debug("invalid scale factor %f\n", factor);
+		return -1;
+	}
+
+	if (params->n_rois < 0 || params->n_rois > MAX_ROIS) {
+		sqface_debug("invalid number of ROIs: %d\n", params->n_rois);
+		return -1;
+	}
+
+	if (params->n_angles < 0 || params->n_angles > MAX_ANGLES) {
+		sqface_debug("invalid number of angles: %d\n", params->n_angles);
+		return -1;
+	}
+
+	if (params->flags & SQFACE_ROTATE_ALL) {
+		// повернутые копии верхних каскадов - один раз, дальше они уже есть
+		int n = n_cascades;
+		for (int i = 0; i < n; i++) {
+			if (cascades[i].parent >= 0 || cascades[i].rot) continue;
+			for (int rot = 1; rot <= 3; rot++) {
+				if (!(params->flags & (SQFACE_ROTATE_90 << (rot-1)))) continue;
+				int k;
+				for (k = 0; k < n_cascades; k++) {
+					if (cascades[k].source == i && cascades[k].rot == rot) break;
+				}
+				if (k == n_cascades && RotateCascade(i, rot) < 0) {
+					sqface_debug("cascade %d: no %d degrees copy\n", i, rot*90);
+					return -1;
+				}
+			}
+		}
+	}
+
+	if ((params->flags & SQFACE_EDGE_PRUNING) && !p4) {
+		if (BuildEdgeIntegral() < 0) return -1;
+	}
+	if ((params->flags & SQFACE_SKIN_PREFILTER) && !p5) {
+		BuildSkinIntegral(); // нет "цветной" картинки - без фильтра
+	}
+	for (int i = 0; i < n_cascades && !p6; i++) {
+		if (cascades[i].type == SQFACE_CASCADE_HAAR && cascades[i].has_tilted &&
+				BuildTiltedIntegral() < 0) return -1;
+	}
+
+	// SQFACE_SCAN_CHANGED: окна прошлого Recognize() - только если он был по
+	// этой же картинке до UpdateGray() и нашел все окна
+	int n_old = n_cached;
+	int changed_only = (params->flags & SQFACE_SCAN_CHANGED) && n_changed >= 0 && n_old >= 0 &&
+		params->n_angles == 0 && params->max_detections == 0 &&
+		!(params->flags & (SQFACE_FIND_BIGGEST | SQFACE_SKIP_FOUND));
+	n_cached = -1;
+
+	memset(&stats, 0, sizeof(stats));
+	n_faces = 0;
+	n_result = 0;
+	n_parts = 0;
+	stop = 0;
+	SetScan(-1, params->flags & SQFACE_ROTATE_ALL);
+	// буферы окон - заново из области: размеры знает она, а не мы
+	size_t size;
+	faces = (TFace *)ws->Reserve(SQFACE_WS_FACES, START_FACES*sizeof(TFace));
+	if (!faces) {
+		sqface_debug("No free memory.\n");
+		return -1;
+	}
+	ws->Get(SQFACE_WS_FACES, &size);
+	max_faces = size/sizeof(TFace);
+	hints = (THint *)ws->Get(SQFACE_WS_HINTS, &size);
+	max_hints = size/sizeof(THint);
+	parts = (TFace *)ws->Get(SQFACE_WS_PARTS, &size);
+	max_parts = size/sizeof(TFace);
+	margins = (float *)ws->Grow(SQFACE_WS_MARGINS, max_faces*n_margins*sizeof(float));
+	if (!margins) {
+		sqface_debug("No free memory.\n");
+		return -1;
+	}
+
+	if (changed_only) {
+		// окна, не задевающие измененных блоков, - как в прошлый раз
+		for (int i = 0; i < n_old; i++) {
+			if (n_changed > 0 && WindowChanged(faces[i].x1, faces[i].y1, faces[i].x2, faces[i].y2)) continue;
+			if (n_faces != i) {
+				faces[n_faces] = faces[i];
+				memcpy(margins+n_faces*n_margins, margins+i*n_margins, n_margins*sizeof(float));
+			}
+			faces[n_faces].raw = n_faces;
+			n_faces++;
+		}
+		scan_changed = 1;
+	}
+
+	// Можно сделать scaling по-убывающей, с наибольших квадратов
+	int largest_first = params->flags & (SQFACE_SCAN_LARGEST_FIRST | SQFACE_FIND_BIGGEST);
+
+	if (!changed_only || n_changed > 0) {
+		ScanScales(factor, params, largest_first);
+	}
+	scan_changed = 0;
+	if (!stop && !(params->flags & SQFACE_SKIP_FOUND)) n_cached = n_faces;
+	BYTE *gray = p1;
+	WORD gray_w = w1, gray_h = h1, gray_stride = stride1;
+	for (int i = 0; i < params->n_angles && !stop; i++) {
+		if (params->angles[i] == 0) continue;
+		rotated = 1;
+		if (ScanRotated(gray, gray_w, gray_h, gray_stride, params->angles[i], factor, params, largest_first) < 0) {
+			rotated = -1;
+			break;
+		}
+	}
+	if (rotated != 0) {
+		// обратно к матрицам исходной картинки (p4, p5 - по требованию)
+		p1 = gray;
+		w1 = gray_w;
+		h1 = gray_h;
+		stride1 = gray_stride;
+		bypp1 = 1;
+		if (BuildIntegrals() < 0) return -1;
+		for (int i = 0; i < n_cascades && !p6; i++) {
+			if (cascades[i].has_tilted && BuildTiltedIntegral() < 0) return -1;
+		}
+		if (rotated < 0) return -1;
+	}
+
+	result = faces;
+	n_result = n_faces;
+	if (params->min_neighbors > 0 && n_faces > 0) {
+		if (GroupFaces(params) < 0) return -1;
+	}
+	if (params->nms_overlap > 0.0 && n_result > 0) {
+		if (SuppressFaces(params->nms_overlap) < 0) return -1;
+	}
+	if (n_scan < n_cascades && n_result > 0 && !skip_parts) {
+		if (RecognizeParts(factor, params) < 0) return -1;
+	}
+	if ((n_result > 0 || n_parts > 0) && p0 && !p5 && (bypp0 == 3 || bypp0 == 4)) {
+		// маска кожи строится по "цветной" картинке - до рамок, иначе следующий
+		// Recognize() с SQFACE_SKIN_PREFILTER увидит их вместо кожи
+		// (модуль градиента - по "серой", ее рамки не трогают)
+		if (BuildSkinIntegral() < 0) return -1;
+	}
+	for (int i = 0; i < n_result; i++) {
+		DrawRect(result[i].x1, result[i].y1, result[i].x2, result[i].y2);
+	}
+	for (int i = 0; i < n_parts; i++) {
+		DrawRect(parts[i].x1, parts[i].y1, parts[i].x2, parts[i].y2);
+	}
+
+	if (n_changed > 0) {
+		// окна faces теперь по этой картинке
+		memset(ch_map, 0, (size_t)n_chx*n_chy);
+		memset(ch_sum, 0, (size_t)(n_chx+1)*(n_chy+1)*sizeof(int));
+		n_changed = 0;
+	} else if (n_changed < 0 && n_cached >= 0) {
+		n_changed = 0;
+	}
+
+	clock_t t2 = clock();
+	sqface_debug("%.4f seconds\n", (t2-t1)/(double)(CLOCKS_PER_SEC));
+	return n_result;
+}
+/* }}} */
+
+// Очередной кадр потока (загружен LoadGray() или LoadImage()). Раз в
+// full_every кадров - обычный Recognize(), на остальных ROI - только прошлые
+// лица с запасом margin, и в каждом - окна в scale_band раз от размера лица;
+// масштабы вне всех полос не строятся. Новые лица появляются с ближайшим
+// полным проходом; потерянные - уходят до него. Следим за результатом
+// группировки или NMS; без них окна группируются только для слежения
+int TFaceRecognizer::RecognizeFrame(float factor, const TRecognizeParams *params, const TTrackParams *track) /* {{{ */
+{
+	TRecognizeParams params_default;
+	TTrackParams track_default;
+	int ret;
+
+	if (!params) params = &params_default;
+	if (!track) track = &track_default;
+	if (track->margin < 0 || track->scale_band < 1) {
+		sqface_debug("invalid tracking params: margin %g, scale band %g\n", track->margin, track->scale_band);
+		return -1;
+	}
+
+	if (n_frames == 0 || track->full_every <= 1 || n_frames >= track->full_every) {
+		ret = Recognize(factor, params);
+		n_frames = 0;
+	} else {
+		TRecognizeParams p = *params;
+		p.flags &= ~SQFACE_SCAN_CHANGED;
+		p.n_rois = 0;
+		p.min_size = 0x7FFFFFFF;
+		p.max_size = 0;
+		for (int i = 0; i < n_tracked; i++) {
+			const TFace *f = &tracked[i];
+			int size = max(f->x2-f->x1, f->y2-f->y1);
+			int m = (int)(track->margin*size);
+			int x1 = max(0, f->x1-m), y1 = max(0, f->y1-m);
+			int x2 = min((int)w1, f->x2+m), y2 = min((int)h1, f->y2+m);
+			int size_min = max(params->min_size, (int)(size/track->scale_band));
+			int size_max = (int)ceil(size*track->scale_band);
+			if (params->max_size > 0) size_max = min(size_max, params->max_size);
+			if (x2 <= x1 || y2 <= y1 || size_max < size_min) continue;
+
+			TRoi *r = &p.rois[p.n_rois++];
+			r->x = x1;
+			r->y = y1;
+			r->w = x2-x1;
+			r->h = y2-y1;
+			r->min_size = size_min;
+			r->max_size = size_max;
+			p.min_size = min(p.min_size, size_min);
+			p.max_size = max(p.max_size, size_max);
+		}
+
+		if (p.n_rois > 0) {
+			ret = Recognize(factor, &p);
+		} else {
+			// следить не за чем - до полного прохода пусто
+			memset(&stats, 0, sizeof(stats));
+			n_faces = 0;
+			n_result = 0;
+			n_parts = 0;
+			ret = 0;
+		}
+		n_cached = -1; // окна - только около лиц, для SQFACE_SCAN_CHANGED не годятся
+	}
+	if (ret < 0) {
+		ResetTracking();
+		return ret;
+	}
+	n_frames++;
+
+	// следить за лицами, а не окнами: одно лицо дает десятки окон, и они
+	// заняли бы все ROI - без группировки (и NMS) у вызывающего сгруппировать
+	const TFace *src = result;
+	int n_src = n_result;
+	if (result == faces && n_faces > 0) {
+		TRecognizeParams p = *params;
+		p.min_neighbors = 0;
+		groups = (TFace *)ws->Reserve(SQFACE_WS_GROUPS, n_faces*sizeof(TFace));
+		n_src = groups ? GroupWindows(faces, n_faces, groups, &p) : -1;
+		if (n_src < 0) {
+			sqface_debug("failed to group windows for tracking\n");
+			ResetTracking();
+			return -1;
+		}
+		src = groups;
+	}
+	n_tracked = min(n_src, MAX_ROIS);
+	for (int i = 0; i < n_tracked; i++) tracked[i] = src[i];
+	return ret;
+}
+/* }}} */
+
+void TFaceRecognizer::ResetTracking() /* {{{ */
+{
+	n_tracked = 0;
+	n_frames = 0;
+}
+/* }}} */
+
+// Есть ли на картинке лицо: сканирование прекращается, как только
+// найдено n окон, прошедших все этапы. Окна не группируются и не
+// подавляются (группировка выкинула бы недосканированные), дочерние
+// каскады не запускаются - вернуть число окон
+int TFaceRecognizer::HasFace(float factor, int n, const TRecognizeParams *params) /* {{{ */
+{
+	TRecognizeParams p;
+
+	if (params) p = *params;
+	p.max_detections = n > 0 ? n : 1;
+	p.min_neighbors = 0;
+	p.nms_overlap = 0;
+	skip_parts = 1;
+	int ret = Recognize(factor, &p);
+	skip_parts = 0;
+	return ret;
+}
+/* }}} */
+
+// Счетчики последнего Recognize() (для сравнения режимов сканирования)
+const TRecognizeStats *TFaceRecognizer::GetStats() /* {{{ */
+{
+	return &stats;
+}
+/* }}} */
+
+// Найденные лица (сгруппированные, если включена группировка)
+int TFaceRecognizer::GetFaceCount() /* {{{ */
+{
+	return n_result;
+}
+/* }}} */
+
+const TFace *TFaceRecognizer::GetFace(int i) /* {{{ */
+{
+	if (i < 0 || i >= n_result) return NULL;
+	return &result[i];
+}
+/* }}} */
+
+// Все окна, прошедшие каскад (до группировки)
+int TFaceRecognizer::GetRawFaceCount() /* {{{ */
+{
+	return n_faces;
+}
+/* }}} */
+
+const TFace *TFaceRecognizer::GetRawFace(int i) /* {{{ */
+{
+	if (i < 0 || i >= n_faces) return NULL;
+	return &faces[i];
+}
+/* }}} */
+
+// Запасы этапов каскада (GetStageCount(i_cascade) чисел) для лица;
+// у группы - для ее лучшего окна
+const float *TFaceRecognizer::GetFaceMargins(int i) /* {{{ */
+{
+	if (i < 0 || i >= n_result) return NULL;
+	return &margins[result[i].raw*n_margins];
+}
+/* }}} */
+
+const float *TFaceRecognizer::GetRawFaceMargins(int i) /* {{{ */
+{
+	if (i < 0 || i >= n_faces) return NULL;
+	return &margins[i*n_margins];
+}
+/* }}} */
+
+// Части лиц от дочерних каскадов (margins - через GetRawFaceMargins(raw))
+int TFaceRecognizer::GetPartCount() /* {{{ */
+{
+	return n_parts;
+}
+/* }}} */
+
+const TFace *TFaceRecognizer::GetPart(int i) /* {{{ */
+{
+	if (i < 0 || i >= n_parts) return NULL;
+	return &parts[i];
+}
+/* }}} */
+
+// Загруженные каскады, без повернутых копий (SQFACE_ROTATE_*): у лиц
+// от копии i_cascade - номер загруженного, от которого она сделана
+int TFaceRecognizer::GetCascadeCount() /* {{{ */
+{
+	int n = n_cascades;
+	while (n > 0 && cascades[n-1].rot) n--;
+	return n;
+}
+/* }}} */
+
+int TFaceRecognizer::GetStageCount(int i_cascade) /* {{{ */
+{
+	if (i_cascade < 0 || i_cascade >= GetCascadeCount()) return 0;
+	return cascades[i_cascade].n_stages;
+}
+/* }}} */
+
 int TFaceRecognizer::GetImageWidth() /* {{{ */
 {
 	return this->w0;
@@ -1,3 +1,6 @@
+#ifndef SQFACE_H
+#define SQFACE_H
+
 
 #include <FreeImage.h>
 #include <stdio.h>  // printf,perror
@@ -6,22 +9,46 @@
 #include <string.h> // strncmp
 #include <math.h>   // floor
 
+namespace rapidxml {
+  template <class Ch> class xml_node;
+}
+
 // ~10-25
 #define MAX_STAGES 100
 // ~1-5 тыс (max)
 #define MAX_FEATURES 10000
 // ~5-10 тыс (max)
 #define MAX_RECTS 30000
+// каскадов на одном детекторе (этапы, признаки и прямоугольники - общие)
+#define MAX_CASCADES 16
 
 // 32-bit
 
 #define SUM_TYPE signed int
 #define SUM_TYPE2 signed int
 
+// Тип каскада
+#define SQFACE_CASCADE_HAAR 0 // признаки Хаара (старый формат OpenCV)
+#define SQFACE_CASCADE_LBP  1 // локальные бинарные шаблоны (lbpcascade_*.xml)
+
 typedef struct {
   int window_w_mini, window_h_mini;
   int n_stages;
   int n_rects;
+  int type; // SQFACE_CASCADE_*
+  int has_tilted; // есть повернутые признаки - нужна матрица p6
+  // место в общих stages[], features[] (lbp_nodes[]) и rects[]
+  int i_stage_1;
+  int i_feature_1, n_features;
+  int i_rect_1;
+  float threshold_sum; // сумма порогов этапов
+  // дочерний каскад (глаза, рот, ...) - только внутри лиц каскада parent
+  int parent;      // < 0 - сканируется по всей картинке
+  float roi[4];    // x1,y1,x2,y2 в долях лица
+  float min_rel, max_rel; // размер окна в долях ширины лица
+  // повернутая копия (SQFACE_ROTATE_*): rot*90 градусов по часовой от source
+  int source;
+  int rot;
 } TXMLCascade;
 
 typedef struct {
@@ -40,6 +67,9 @@ typedef struct {
   float feature_threshold;
   int i_rect_abs_1;
   int i_rect_abs_2;
+  int left, right; // > 0 - смещение дочернего узла дерева, 0 - лист (left_val/right_val)
+  int n_nodes;     // у корня дерева - узлов в дереве (1 - "пень")
+  int tilted;      // повернут на 45 градусов: прямоугольники по p6
 } TFeature;
 
 typedef struct {
@@ -51,15 +81,230 @@ typedef struct {
   int weight;
 } TRect;
 
+// Узел LBP-каскада: признак - 3x3 блока w x h от (x,y) из rects[i_rect];
+// код LBP (8 соседей >= центра) выбирает бит из subset: есть - left_val
+typedef struct {
+  int i_rect;
+  int subset[8];
+  float left_val;
+  float right_val;
+} TLBPNode;
+
+// Окно на одном масштабе
+#define MAX_W 120
+typedef struct {
+  float dscale;
+  int window_w, window_h;
+  float inv;
+  int x_step, y_step;
+  int a_ds[MAX_W]; // отмасштабированные координаты 0..MAX_W-1
+  // редкая сетка (SQFACE_SCAN_COARSE_TO_FINE)
+  int cx_step, cy_step;
+  int n_cx, n_cy;
+  BYTE *map; // глубина по каскаду, потом маска уточнения
+} TScale;
+
+// Проходы по сетке окон
+#define SQFACE_PASS_ALL    0
+#define SQFACE_PASS_COARSE 1 // редкая сетка, запомнить глубину
+#define SQFACE_PASS_FINE   2 // остальные позиции рядом с "глубокими" окнами
+#define SQFACE_PASS_MASK   3 // позиции, отмеченные в map (по одной на узел сетки)
+
+// Центр окна, глубоко прошедшего каскад на грубом масштабе
+typedef struct {
+  int xc, yc;
+} THint;
+
+// Политика шага окна
+#define SQFACE_STEP_DEFAULT  0 // max(1, min(4, окно/10))
+#define SQFACE_STEP_FIXED    1 // step пикселей
+#define SQFACE_STEP_RELATIVE 2 // доля step_rel от окна, не меньше 1
+
+#define MAX_ROIS 64
+// отрезков строки: ROI плюс дырки от найденных лиц
+#define MAX_SPANS 256
+#define MAX_SCALES 1024
+
+// Флаги Recognize()
+#define SQFACE_SCAN_LARGEST_FIRST 0x0001 // масштабы от больших окон к маленьким
+#define SQFACE_FIND_BIGGEST       0x0002 // остановиться на первом (самом большом) лице
+#define SQFACE_SKIP_FOUND         0x0004 // не искать внутри уже найденных лиц
+#define SQFACE_SCAN_COARSE_TO_FINE 0x0008 // редкая сетка, потом полная рядом с "глубокими" окнами
+#define SQFACE_SCAN_SCALE_REFINE  0x0010 // масштабы через coarse_factor, промежуточные - только около "глубоких" окон
+#define SQFACE_SCAN_XSCALE_HINTS  0x0020 // пропускать позиции, отсеянные рано на предыдущем масштабе
+#define SQFACE_EDGE_PRUNING       0x0040 // отсеивать окна по плотности границ (как CV_HAAR_DO_CANNY_PRUNING)
+#define SQFACE_SKIN_PREFILTER     0x0080 // отсеивать окна, где мало пикселей цвета кожи (нужна "цветная" картинка)
+#define SQFACE_ROTATE_90          0x0100 // искать и лица, повернутые на 90 градусов по часовой (тот же проход)
+#define SQFACE_ROTATE_180         0x0200 // ... на 180
+#define SQFACE_ROTATE_270         0x0400 // ... на 270
+#define SQFACE_ROTATE_ALL (SQFACE_ROTATE_90 | SQFACE_ROTATE_180 | SQFACE_ROTATE_270)
+// (повернутые копии каскадов - в тех же stages[], features[], rects[]: не
+// влезли или окно не квадратное - Recognize() вернет -1)
+#define SQFACE_SCAN_CHANGED       0x0800 // только окна, задевающие блоки, измененные UpdateGray(); остальные - из прошлого Recognize()
+
+// Наклонов (не кратных 90 градусам) за один Recognize()
+#define MAX_ANGLES 8
+
+typedef struct {
+  int x, y;
+  int w, h;
+  int min_size, max_size; // окна здесь - только такие (0 - как в TRecognizeParams)
+} TRoi;
+
+// Параметры Recognize()
+struct TRecognizeParams {
+  int min_size; // лица меньше (в пикселях) не искать
+  int max_size; // ... и больше тоже; 0 - до размера картинки
+  int step_policy;
+  int step;       // для SQFACE_STEP_FIXED
+  float step_rel; // для SQFACE_STEP_RELATIVE
+  float min_stddev;      // более "ровные" окна отбрасываются до каскада
+  float min_face_stddev; // ... и не засчитываются как лица
+  int flags; // SQFACE_SCAN_*, SQFACE_FIND_*
+  int max_detections; // остановиться, найдя столько лиц; 0 - искать все
+  int min_neighbors; // > 0 - группировать окна, оставляя группы больше min_neighbors
+  float group_eps;   // насколько могут отличаться окна одной группы
+  float nms_overlap; // > 0 - подавлять лица, перекрытые (IoU) более уверенными
+  int coarse_step;  // шаг редкой сетки, в шагах полной
+  int refine_depth; // уточнять вокруг окон, прошедших столько этапов
+  float coarse_factor; // шаг грубых масштабов для SQFACE_SCAN_SCALE_REFINE
+  int scale_refine_depth; // ... и глубина окон, вокруг которых ставятся промежуточные
+  int xscale_depth; // SQFACE_SCAN_XSCALE_HINTS: пропускать, если рядом на прошлом масштабе не прошли столько этапов
+  int xscale_cell;  // ... размер ячейки карты глубины, пикселей
+  float min_edge_density; // SQFACE_EDGE_PRUNING: допустимый средний модуль градиента
+  float max_edge_density; // окна / stddev (у лиц около 0.5); 0 - без верхней границы
+  float min_skin_fraction; // SQFACE_SKIN_PREFILTER: доля пикселей цвета кожи в окне
+  int n_rois; // 0 - вся картинка, иначе окно целиком внутри одного из rois
+  TRoi rois[MAX_ROIS];
+  // еще наклоны лица (градусы, по часовой): на каждый - повернутая копия
+  // картинки и ее матрицы, общие для всех масштабов
+  int n_angles;
+  float angles[MAX_ANGLES];
+
+  TRecognizeParams(); // по умолчанию - как Recognize(factor)
+};
+
+// Параметры RecognizeFrame() (поток кадров)
+struct TTrackParams {
+  int full_every;   // вся картинка - раз в столько кадров, между ними - только около прошлых лиц
+  float margin;     // запас вокруг прошлого лица, в долях его размера
+  float scale_band; // окна от size/scale_band до size*scale_band
+                    // (и не больше лица с запасом)
+  TTrackParams();
+};
+
+// Счетчики последнего Recognize()
+typedef struct {
+  int n_scales;
+  unsigned long long n_windows;           // позиций окна
+  unsigned long long n_windows_evaluated; // ... прошедших проверку дисперсии
+  unsigned long long n_rects;             // сумм по прямоугольникам в каскаде
+  unsigned long long n_windows_skipped;   // позиций, пропущенных по карте прошлого масштаба
+  int n_faces;
+} TRecognizeStats;
+
+// Флаги LoadImage()
+#define SQFACE_LOAD_GRAY 0x0001 // только яркость, без "цветной" картинки (SaveImage() недоступен)
+#define SQFACE_LOAD_SQSUM_HALF    0x0002 // матрица квадратов по блокам 2x2 (дисперсия окна - приближенно)
+#define SQFACE_LOAD_SQSUM_QUARTER 0x0004 // ... по блокам 4x4
+#define SQFACE_LOAD_SUM16         0x0008 // "интегральная" матрица - 16 бит внутри блоков (вдвое меньше памяти)
+
+// Блоки сравнения кадров UpdateGray(): 16x16
+#define SQFACE_CHANGE_SHIFT 4
+
 struct TFace {
   int x1;
   int y1;
   int x2;
   int y2;
   int f; // признак
+  float score;      // сумма по всем этапам каскада (у группы - лучшая)
+  float confidence; // запас над порогами этапов (у группы - сумма по окнам)
+  int neighbors;    // окон в группе (0 - не группировали)
+  int depth;        // пройдено этапов каскада
+  int raw;          // номер окна (у группы - лучшего) для GetRawFace*()
+  int i_cascade;    // номер каскада (в порядке загрузки; у повернутых SQFACE_ROTATE_* - исходного)
+  int parent;       // у части (дочерний каскад) - номер лица для GetFace(), иначе -1
+  float angle;      // наклон лица, градусы по часовой (0 - прямо)
+};
+
+// Окно при группировке
+typedef struct {
+  int next;   // следующее в ячейке хэш-сетки
+  int parent; // union-find
+  int ks, kx, ky; // ячейка
+} TGroupItem;
+
+
+
+// Слоты рабочей области
+enum {
+  SQFACE_WS_GRAY = 0, // "серая" картинка
+  SQFACE_WS_SUM,      // "интегральная" матрица
+  SQFACE_WS_SQSUM,    // "интегральная" матрица из "квадратов"
+  SQFACE_WS_FACES,    // найденные лица
+  SQFACE_WS_DEPTH,    // глубина окон по каскаду на одном масштабе
+  SQFACE_WS_MASK,     // маска окон на одном масштабе
+  SQFACE_WS_HINTS,    // "глубокие" окна грубых масштабов
+  SQFACE_WS_GROUP,    // хэш-сетка группировки
+  SQFACE_WS_GROUPS,   // сгруппированные лица
+  SQFACE_WS_MARGINS,  // запасы этапов каскада у найденных окон
+  SQFACE_WS_XSCALE,   // карты глубины прошлого и текущего масштаба
+  SQFACE_WS_EDGES,    // интегральная матрица модуля градиента
+  SQFACE_WS_SKIN,     // интегральная матрица маски цвета кожи
+  SQFACE_WS_TILTED,   // повернутая на 45 градусов интегральная матрица
+  SQFACE_WS_PARTS,    // части лиц от дочерних каскадов
+  SQFACE_WS_ROTATED,  // повернутая копия "серой" картинки (наклоны лица)
+  SQFACE_WS_CHANGED,  // измененные блоки кадра (UpdateGray()) и их накопленные суммы
+  SQFACE_WS_MAX
 };
 
+// Выравнивание буферов (строка кэша)
+#define SQFACE_WS_ALIGN 64
 
+// Флаги рабочей области (для буферов от SQFACE_HUGEPAGE_SIZE и больше)
+#define SQFACE_WS_THP      0x0001 // transparent huge pages, madvise(MADV_HUGEPAGE)
+#define SQFACE_WS_HUGETLB  0x0002 // явные huge pages (MAP_HUGETLB), иначе как SQFACE_WS_THP
+#define SQFACE_WS_PREFAULT 0x0004 // коснуться всех страниц сразу при выделении
+#define SQFACE_WS_MLOCK    0x0008 // mlock(), чтобы не вытеснялись
+#define SQFACE_HUGEPAGE_SIZE (2*1024*1024)
+#define SQFACE_PAGE_SIZE 4096 // SQFACE_WS_MLOCK из кучи - целыми страницами
+
+// Рабочая область: буферы под картинку и интегральные матрицы,
+// которые только растут и живут между картинками. На потоке картинок
+// одного размера после первой LoadImage() аллокаций больше нет.
+// Может быть общей для нескольких распознавателей, но не одновременно:
+// картинка и результаты распознавателя живут до того, как областью
+// воспользуется другой (его Load*() или Recognize())
+class TFaceWorkspace {
+private:
+  void *bufs[SQFACE_WS_MAX];
+  size_t sizes[SQFACE_WS_MAX];
+  size_t mapped[SQFACE_WS_MAX]; // > 0 - получен через mmap()
+  size_t locked[SQFACE_WS_MAX]; // > 0 - из кучи под mlock(), перед free() - munlock()
+  int in_arena[SQFACE_WS_MAX];
+  BYTE *arena; // заранее выделенный кусок (необязательно)
+  size_t arena_size;
+  size_t arena_used;
+  size_t arena_mapped;
+  size_t arena_locked;
+  int flags;
+  int n_allocs;
+  const void *owner; // кто пользовался последним
+
+  void *Alloc(size_t size, size_t *mapped, size_t *locked);
+  void Free(void *ptr, size_t mapped, size_t locked);
+
+public:
+  TFaceWorkspace(size_t arena_size = 0, int flags = 0); // arena_size > 0 - брать буферы из арены
+  ~TFaceWorkspace();
+  void *Reserve(int slot, size_t size); // Буфер слота, выровненный на SQFACE_WS_ALIGN
+  void *Grow(int slot, size_t size); // То же, с сохранением содержимого
+  void *Get(int slot, size_t *size = NULL); // Текущий буфер слота (NULL - еще нет) и его размер
+  int Claim(const void *user); // Запомнить пользователя; 1 - до него пользовался другой
+  size_t GetSize(); // Сколько памяти держит
+  int GetAllocCount(); // Сколько раз обращались к аллокатору
+};
 
 // Основан на каскадах Хаара
 class TFaceRecognizer {
@@ -71,10 +316,8 @@ private:
   WORD bpp0;
   WORD bypp0;
   WORD stride0;
-  FIBITMAP *dibo; // draw
 
-  // "Серая" картинка
-  FIBITMAP *dib1;
+  // "Серая" картинка (в рабочей области)
   WORD w1,h1;
   BYTE *p1;
   WORD bpp1;
@@ -88,36 +331,195 @@ private:
   WORD bypp2;
   WORD stride2;
 
+  // Сжатая "интегральная" матрица (SQFACE_LOAD_SUM16, вместо p2):
+  // I(x,y) = c_left[y][bx] + c_top[by][x] + c_local[y][x], блоки 16x16
+#define SQFACE_BLOCK_SHIFT 4
+  int sum16;
+  WORD *c_local;    // сумма внутри блока до (x,y) включительно, <= 16*16*255
+  SUM_TYPE *c_left; // I(X0-1,y) - I(X0-1,Y0-1), h2 x n_bx
+  SUM_TYPE *c_top;  // I(x,Y0-1), n_by x w2
+  int n_bx, n_by;
+
   // "Интегральная" матрица из "квадратов"
   WORD w3,h3;
   SUM_TYPE2 *p3; // not BYTE *
   WORD bpp3;
   WORD bypp3;
   WORD stride3;
+  int sq_shift; // p3 - по блокам (1 << sq_shift) x (1 << sq_shift)
 
-  // Каскад Хаара
+  // "Интегральная" матрица модуля градиента (строится по требованию)
+  WORD w4,h4;
+  unsigned int *p4; // беззнаковая: разности верны и при переполнении
+
+  // "Интегральная" матрица маски цвета кожи (по "цветной" картинке, по требованию)
+  WORD w5,h5;
+  unsigned int *p5;
+
+  // Повернутая на 45 градусов "интегральная" матрица (w1+1) x (h1+1),
+  // только для каскадов с <tilted>1</tilted>
+  int w6,h6;
+  unsigned int *p6;
+
+  // Каскады: верхние - все с одним размером окна, сканируются за один проход;
+  // дочерние - потом, каждый по-своему внутри лиц родителя
   const char *filename_i_txt;
-  TXMLCascade cascade;
+  TXMLCascade cascades[MAX_CASCADES];
+  int n_cascades;
+  int n_margins; // запасов этапов на найденное окно - по самому длинному каскаду
+  int scan[MAX_CASCADES]; // каскады текущего прохода
+  int n_scan;
+  int scan_lbp;  // все они LBP - дисперсия окна не нужна
   TStage stages[MAX_STAGES];
   TFeature features[MAX_FEATURES];
   TRect rects[MAX_RECTS];
+  TLBPNode lbp_nodes[MAX_FEATURES]; // SQFACE_CASCADE_LBP (вместо features[])
+
+  TFaceWorkspace *ws;
+  int ws_own;
+
+  TRecognizeStats stats;
+
+  // Найденные лица (в рабочей области)
+  TFace *faces;
+  int n_faces;
+  int max_faces;
+  int stop; // прекратить сканирование
+  int skip_parts; // HasFace(): без дочерних каскадов
+
+  // Результат: faces или groups
+  TFace *groups;
+  TFace *result;
+  float *margins; // n_stages на каждое из faces
+  int n_result;
+
+  // Части лиц от дочерних каскадов (в рабочей области)
+  TFace *parts;
+  int n_parts;
+  int max_parts;
+
+  // Подсказки для промежуточных масштабов (в рабочей области)
+  THint *hints;
+  int n_hints;
+  int max_hints;
+  int record_hints; // > 0 - запоминать окна, прошедшие столько этапов
+
+  // Карты глубины по ячейкам центров окон (SQFACE_SCAN_XSCALE_HINTS)
+  BYTE *xs_prev; // прошлый масштаб; NULL - режим выключен
+  BYTE *xs_cur;  // текущий
+  int xs_cell, xs_w, xs_h;
+
+  // Поток кадров (RecognizeFrame()): лица прошлого кадра
+  TFace tracked[MAX_ROIS];
+  int n_tracked;
+  int n_frames; // кадров с последнего полного прохода
+
+  // Измененные блоки (UpdateGray(), SQFACE_SCAN_CHANGED, в рабочей области)
+  BYTE *ch_map;  // n_chy x n_chx: 1 - изменился после прошлого Recognize()
+  int *ch_sum;   // (n_chy+1) x (n_chx+1) накопленных сумм ch_map
+  int n_chx, n_chy;
+  int n_changed; // < 0 - неизвестно (новая картинка)
+  int n_cached;  // окон прошлого Recognize() в начале faces, годных для SQFACE_SCAN_CHANGED (< 0 - нет)
+  int scan_changed; // сейчас - только окна, задевающие измененные блоки
+
+  int ConvertGray(FIBITMAP *dib); // Перевести в градации серого
+  int BuildIntegrals(int y0 = 0); // Посчитать интегральные матрицы (с y0 - строки выше те же, что были)
+  int BuildSum16(); // ... сжатую вместо p2
+  int BuildEdgeIntegral(); // ... и матрицу модуля градиента
+  int BuildSkinIntegral(); // ... и маски цвета кожи
+  int BuildTiltedIntegral(); // ... и повернутую матрицу
+  void DrawRect(int x1, int y1, int x2, int y2); // Нарисовать рамку
+  void SetupScale(TScale *sc, float dscale, const TRecognizeParams *params);
+  void ScanScale(TScale *sc, const TRecognizeParams *params);
+  void ScanGrid(const TScale *sc, const TRecognizeParams *params, int pass);
+  int CutSpan(int *span_lo, int *span_hi, int n_spans, int lo, int hi);
+  int KeepChanged(int *span_lo, int *span_hi, int n_spans, int y1, const TScale *sc);
+  int WindowChanged(int x1, int y1, int x2, int y2);
+  int AddFace(int i_cascade, int x1, int y1, int x2, int y2, float score);
+  int GroupFaces(const TRecognizeParams *params);
+  int GroupWindows(const TFace *src, int n, TFace *dst, const TRecognizeParams *params);
+  void SetScan(int i_sub, int rotations = 0);
+  int RotateCascade(int i_src, int rot);
+  void ScanScales(float factor, const TRecognizeParams *params, int largest_first);
+  int ScanRotated(const BYTE *src, int sw, int sh, int sstride, float angle, float factor, const TRecognizeParams *params, int largest_first);
+  int RecognizeParts(float factor, const TRecognizeParams *params);
+  int AddParts(int i, int n0, const TRecognizeParams *params);
+  int AddCascade(const char *filename_i, int i_parent);
+  int SuppressFaces(float overlap);
+  int BuildScales(float dscale, float factor, const TRecognizeParams *params, float *scales, int max_scales);
+  void RecognizeRefined(float factor, const TRecognizeParams *params, int largest_first);
+  int PrepareHintMask(TScale *sc, const int *hint_lo, const int *hint_hi, int k1, int k2);
+  void AddHint(int xc, int yc);
+  void ClaimWorkspace();
+  int PrepareXScale(const TRecognizeParams *params);
+  inline int ScanWindow(const TScale *sc, int x1, int y1, const TRecognizeParams *params);
+  inline int EvalWindow(const TXMLCascade *c, const TScale *sc, int x1, int y1, float stddev, float *score, float *stage_margins);
+  template <int SUM16>
+  inline SUM_TYPE i_at(int x, int y);
+  template <int SUM16>
+  inline int EvalLBP(const TXMLCascade *c, const TScale *sc, int x1, int y1, float *score, float *stage_margins);
+  int LoadCascadeHaar(TXMLCascade *c, rapidxml::xml_node<char> *node);
+  int LoadCascadeLBP(TXMLCascade *c, rapidxml::xml_node<char> *node);
+  template <int SUM16, int TILTED>
+  inline int EvalStages(const TXMLCascade *c, const TScale *sc, int x1, int y1, float stddev, float *score, float *stage_margins);
 
 public:
 #define START_FACES 2000
   TFaceRecognizer(); // Конструктор
   ~TFaceRecognizer(); // Деструктор
-  int LoadImage(const char *filename_i); // Загрузить изображение
+  int LoadImage(const char *filename_i, int flags = 0); // Загрузить изображение
+  int LoadBitmap(FIBITMAP *dib, int flags = 0); // ... уже декодированное (dib переходит распознавателю)
+  // Только декодировать файл с теми же flags (FreeImage_Load() в другом потоке); NULL - ошибка
+  static FIBITMAP *DecodeImage(const char *filename_i, int flags = 0);
+  // ... или готовую яркость (Y-плоскость кадра, строки сверху вниз); без "цветной" картинки
+  int LoadGray(const BYTE *src, int w, int h, int stride, int flags = 0);
+  // ... или следующий кадр того же размера: переписать только блоки, где яркость
+  // изменилась больше threshold (для SQFACE_SCAN_CHANGED); вернуть их число
+  int UpdateGray(const BYTE *src, int w, int h, int stride, int flags = 0, int threshold = 0);
   int LoadCascadeXML(const char *filename_i); // Загрузить каскад Хаара в XML-формате
+  int AddCascadeXML(const char *filename_i); // ... и еще один (тот же размер окна); вернуть его номер
+  // Дочерний каскад: искать только внутри лиц каскада i_parent, в области roi
+  // (x1,y1,x2,y2 в долях лица; NULL - все лицо), окнами min_rel..max_rel ширины лица
+  int AddSubCascadeXML(const char *filename_i, int i_parent, const float *roi = NULL, float min_rel = 0.1, float max_rel = 0.6);
   int SaveImage(const char *filename_o); // Записать изображение
   int UnloadImage(); // Выгрузить изображение
-  int Recognize(float factor); // Распознать лица
+  void SetWorkspace(TFaceWorkspace *workspace); // Внешняя рабочая область (NULL - своя)
+  int Recognize(float factor); // Распознать лица (без аллокаций); вернуть их число
+  int Recognize(float factor, const TRecognizeParams *params);
+  int HasFace(float factor, int n = 1, const TRecognizeParams *params = NULL); // Найти хотя бы n окон-лиц (без группировки)
+  // Очередной кадр потока: как Recognize(), но между полными проходами
+  // только около лиц прошлого кадра и близкими к ним размерами окна.
+  // Лица для слежения - сгруппированные (min_neighbors) или после NMS
+  // (nms_overlap); если не задано ни то, ни другое, окна группируются
+  // (как с min_neighbors = 0) только для слежения, результат - окна
+  int RecognizeFrame(float factor, const TRecognizeParams *params = NULL, const TTrackParams *track = NULL);
+  void ResetTracking(); // Следующий кадр - с полного прохода
+  const TRecognizeStats *GetStats(); // Счетчики последнего Recognize()
+  int GetFaceCount(); // Сколько лиц нашел последний Recognize()
+  const TFace *GetFace(int i);
+  int GetRawFaceCount(); // ... и окон до группировки
+  const TFace *GetRawFace(int i);
+  int GetCascadeCount(); // загруженные, без повернутых копий
+  int GetStageCount(int i_cascade = 0);
+  const float *GetFaceMargins(int i); // запас каждого этапа над порогом (GetStageCount(i_cascade) чисел)
+  const float *GetRawFaceMargins(int i);
+  int GetPartCount(); // Части лиц от дочерних каскадов (parent - номер лица)
+  const TFace *GetPart(int i);
   int GetImageWidth();
   int GetImageHeight();
   inline SUM_TYPE f_sum1(int x_s, int y_s, int w_r_scaled, int h_r_scaled);
+  inline SUM_TYPE c_at(int x, int y);
+  inline SUM_TYPE w_sum1(int x_s, int y_s, int w_r_scaled, int h_r_scaled);
+  inline SUM_TYPE c_sum1(int x_s, int y_s, int w_r_scaled, int h_r_scaled);
   inline SUM_TYPE2 f_sum2(int x_s, int y_s, int w_r_scaled, int h_r_scaled);
+  inline float WindowVariance(int x_s, int y_s, int w_r_scaled, int h_r_scaled, float inv);
+  inline unsigned int e_sum(int x_s, int y_s, int w_r_scaled, int h_r_scaled);
+  inline unsigned int k_sum(int x_s, int y_s, int w_r_scaled, int h_r_scaled);
+  inline int t_sum(int x_s, int y_s, int w_r_scaled, int h_r_scaled);
   inline SUM_TYPE s_sum1(int x_s, int y_s, int w_r_scaled, int h_r_scaled);
   inline SUM_TYPE2 s_sum2(int x_s, int y_s, int w_r_scaled, int h_r_scaled);
   inline float g_sum1(int x_s, int y_s, int w_r_scaled, int h_r_scaled);
   inline float g_sum2(int x_s, int y_s, int w_r_scaled, int h_r_scaled);
 };
 
+#endif